@@ -0,0 +1,409 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Lookups like geoip.lookup("8.8.8.8") are made with the same arguments
+		over and over. When a function has a TTL set, every call to it gets a
+		key made from the module, function, return format and the raw argument
+		cells, and a successful result is kept under that key until the TTL
+		runs out.
+
+		The cache is only ever touched from the server's main thread: lookups
+		happen when a native is called and results are stored as amx_tick
+		delivers them, so there's no locking. Entries are kept in least
+		recently used order and the oldest are evicted once the cache is full.
+
+		The same key is used to coalesce identical calls that are in flight
+		at the same time (single-flight), which is what happens when a burst
+		of players join at once and none of the lookups has finished yet.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <set>
+#include <iterator>
+#include <chrono>
+
+using std::string;
+using std::map;
+using std::list;
+using std::unordered_map;
+using std::set;
+
+#include "main.hpp"
+
+#include "cache.hpp"
+
+
+struct cache_entry_t
+{
+	string key;
+	string returns;
+	vector<Pawpy::pyarg_t> results;
+	std::chrono::steady_clock::time_point expires;
+	size_t size;
+};
+
+unsigned int Pawpy::cache_hits = 0;
+unsigned int Pawpy::cache_misses = 0;
+
+static unsigned int cache_max_entries = 0;
+static size_t cache_size = 0;
+
+/*
+	Note:
+	TTLs in milliseconds, keyed by the module and function names (see
+	name_pair). A function that isn't in here is never cached.
+*/
+static map<unsigned long long, unsigned int> cache_ttls;
+
+/*
+	Note:
+	Most recently used at the front. The index points into the list so hits
+	can be moved to the front without a search.
+*/
+static list<cache_entry_t> cache_order;
+static unordered_map<string, list<cache_entry_t>::iterator> cache_index;
+
+
+static void remove_entry(list<cache_entry_t>::iterator entry)
+{
+	cache_size -= entry->size;
+	cache_index.erase(entry->key);
+	cache_order.erase(entry);
+}
+
+/*
+	Note:
+	Builds the key for a call. Arguments are appended as their raw cells so
+	two calls share a key only if Python would have been given exactly the
+	same values. The key starts with the module and function so entries for
+	a module can be found by prefix.
+*/
+static string make_key(const Pawpy::pycall_t& call)
+{
+	string key;
+
+	key.reserve(call.module.size() + call.function.size() + call.return_format.size() + 3 + call.arguments.size() * 8);
+
+	key += call.module;
+	key += '\0';
+	key += call.function;
+	key += '\0';
+	key += call.return_format;
+	key += '\0';
+
+	for(auto& arg : call.arguments)
+	{
+		key += arg.type;
+		key.append(reinterpret_cast<const char*>(&arg.value), sizeof(arg.value));
+
+		if(!arg.cells.empty())
+		{
+			cell count = arg.cells.size();
+			key.append(reinterpret_cast<const char*>(&count), sizeof(count));
+			key.append(reinterpret_cast<const char*>(arg.cells.data()), arg.cells.size() * sizeof(cell));
+		}
+	}
+
+	return key;
+}
+
+/*
+	Note:
+	Called once from Load. Zero disables the cache, SetPythonCacheTTL then
+	has no effect.
+*/
+void Pawpy::cache_start(unsigned int max_entries)
+{
+	cache_max_entries = max_entries;
+}
+
+/*
+	Note:
+	Sets how long, in milliseconds, results of a function are kept. Zero stops
+	caching the function and drops whatever was cached for it.
+*/
+void Pawpy::cache_set_ttl(const string& module, const string& function, unsigned int ttl)
+{
+	unsigned long long name = name_pair(module, function);
+
+	if(ttl > 0)
+	{
+		cache_ttls[name] = ttl;
+		return;
+	}
+
+	cache_ttls.erase(name);
+
+	string prefix = module + '\0' + function + '\0';
+
+	for(auto it = cache_order.begin(); it != cache_order.end();)
+	{
+		auto entry = it++;
+
+		if(entry->key.compare(0, prefix.size(), prefix) == 0)
+			remove_entry(entry);
+	}
+}
+
+/*
+	Note:
+	Checks the cache for a call that's about to be made. On a hit the cached
+	result is copied into the call and true is returned, the caller delivers
+	it without running any Python. On a miss for a cached function the call's
+	cache_key is set so cache_store knows to keep its result.
+*/
+bool Pawpy::cache_lookup(pycall_t& call)
+{
+	if(cache_max_entries == 0 || cache_ttls.empty())
+		return false;
+
+	if(cache_ttls.find(name_pair(call.module, call.function)) == cache_ttls.end())
+		return false;
+
+	string key = make_key(call);
+	auto found = cache_index.find(key);
+
+	if(found != cache_index.end())
+	{
+		auto entry = found->second;
+
+		if(entry->expires > std::chrono::steady_clock::now())
+		{
+			cache_order.splice(cache_order.begin(), cache_order, entry);
+
+			call.returns = entry->returns;
+			call.results = entry->results;
+			call.failed = false;
+			call.cache_key.clear();
+
+			cache_hits++;
+
+			return true;
+		}
+
+		remove_entry(entry);
+	}
+
+	call.cache_key = std::move(key);
+	cache_misses++;
+
+	return false;
+}
+
+/*
+	Note:
+	Keeps the result of a finished call if cache_lookup marked it as one to
+	cache. Failed calls are never cached so an error is retried next time.
+*/
+void Pawpy::cache_store(const pycall_t& call)
+{
+	if(call.cache_key.empty() || call.failed)
+		return;
+
+	auto ttl = cache_ttls.find(name_pair(call.module, call.function));
+
+	if(ttl == cache_ttls.end())
+		return;
+
+	auto found = cache_index.find(call.cache_key);
+
+	if(found != cache_index.end())
+		remove_entry(found->second);
+
+	cache_entry_t entry;
+
+	entry.key = call.cache_key;
+	entry.returns = call.returns;
+	entry.results = call.results;
+	entry.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl->second);
+	entry.size = sizeof(cache_entry_t) + entry.key.size() + entry.returns.size();
+
+	for(auto& result : entry.results)
+		entry.size += sizeof(Pawpy::pyarg_t) + result.cells.size() * sizeof(cell);
+
+	cache_size += entry.size;
+
+	cache_order.push_front(std::move(entry));
+	cache_index[cache_order.front().key] = cache_order.begin();
+
+	while(cache_order.size() > cache_max_entries)
+		remove_entry(std::prev(cache_order.end()));
+}
+
+/*
+	Note:
+	Drops every entry for a module, or everything when module is empty. Used
+	when a module is reloaded since its functions may now return something
+	else.
+*/
+void Pawpy::cache_clear(const string& module)
+{
+	if(module.empty())
+	{
+		cache_order.clear();
+		cache_index.clear();
+		cache_size = 0;
+		return;
+	}
+
+	string prefix = module + '\0';
+
+	for(auto it = cache_order.begin(); it != cache_order.end();)
+	{
+		auto entry = it++;
+
+		if(entry->key.compare(0, prefix.size(), prefix) == 0)
+			remove_entry(entry);
+	}
+}
+
+unsigned int Pawpy::cache_entries()
+{
+	return cache_order.size();
+}
+
+/*
+	Note:
+	An estimate of the memory used by cached entries, in bytes. Only the keys,
+	results and entry structures are counted, not the containers' overhead.
+*/
+unsigned int Pawpy::cache_memory()
+{
+	return cache_size;
+}
+
+
+/*==============================================================================
+
+	In-flight calls
+
+==============================================================================*/
+
+
+unsigned int Pawpy::flight_coalesced = 0;
+
+/*
+	Note:
+	Functions that coalesce, keyed like the TTLs. Cached functions always
+	coalesce since they've been declared as pure already.
+*/
+static set<unsigned long long> flight_functions;
+
+/*
+	Note:
+	Calls waiting on an identical call that's queued or running, keyed by the
+	call key. The entry is created when that first call is submitted, with no
+	waiters, and removed when it's delivered.
+*/
+static unordered_map<string, vector<Pawpy::pycall_t>> flights;
+
+
+/*
+	Note:
+	Coalescing is opt in because functions with side effects (sending a
+	message, writing a file) must still run once per call.
+*/
+void Pawpy::flight_set(const string& module, const string& function, bool enabled)
+{
+	if(enabled)
+		flight_functions.insert(name_pair(module, function));
+	else
+		flight_functions.erase(name_pair(module, function));
+}
+
+/*
+	Note:
+	Called just before a call is submitted. If an identical call is already in
+	flight, the call is moved into its waiters and true is returned. Otherwise
+	the call becomes the one the next identical calls wait on.
+*/
+bool Pawpy::flight_join(pycall_t& call)
+{
+	if(call.cache_key.empty())
+	{
+		if(flight_functions.empty() || flight_functions.find(name_pair(call.module, call.function)) == flight_functions.end())
+			return false;
+
+		call.cache_key = make_key(call);
+	}
+
+	auto found = flights.find(call.cache_key);
+
+	if(found != flights.end())
+	{
+		found->second.push_back(std::move(call));
+		flight_coalesced++;
+		return true;
+	}
+
+	flights[call.cache_key];
+	call.coalesced = true;
+
+	return false;
+}
+
+/*
+	Note:
+	Forgets a call that flight_join let through but which then couldn't be
+	submitted. Nothing can have joined it in between.
+*/
+void Pawpy::flight_abort(const string& key)
+{
+	if(!key.empty())
+		flights.erase(key);
+}
+
+/*
+	Note:
+	Called by amx_tick as a finished call is delivered. Every call that was
+	waiting on it gets a copy of the result and is put at the front of the
+	backlog so they're delivered straight after, each to its own callback.
+*/
+void Pawpy::flight_land(const pycall_t& call, ring_queue<pycall_t>& backlog)
+{
+	if(!call.coalesced)
+		return;
+
+	auto found = flights.find(call.cache_key);
+
+	if(found == flights.end())
+		return;
+
+	vector<pycall_t> waiters = std::move(found->second);
+	flights.erase(found);
+
+	for(auto it = waiters.rbegin(); it != waiters.rend(); ++it)
+	{
+		it->returns = call.returns;
+		it->results = call.results;
+		it->failed = call.failed;
+		it->timed_out = call.timed_out;
+		it->cache_key.clear();
+
+		backlog.push_front(std::move(*it));
+	}
+}
@@ -0,0 +1,67 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The result cache. Functions that always return the same thing for the
+		same arguments can opt in with SetPythonCacheTTL and repeated calls
+		are answered without running any Python. Identical calls made while
+		one is still running can also share its result. See the .cpp for
+		details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_CACHE_H
+#define PAWPY_CACHE_H
+
+#include <string>
+
+using std::string;
+
+#include "main.hpp"
+#include "pawpy.hpp"
+#include "ring.hpp"
+
+
+namespace Pawpy
+{
+
+extern unsigned int cache_hits;
+extern unsigned int cache_misses;
+extern unsigned int flight_coalesced;
+
+void cache_start(unsigned int max_entries);
+void cache_set_ttl(const string& module, const string& function, unsigned int ttl);
+bool cache_lookup(pycall_t& call);
+void cache_store(const pycall_t& call);
+void cache_clear(const string& module);
+
+void flight_set(const string& module, const string& function, bool enabled);
+bool flight_join(pycall_t& call);
+void flight_abort(const string& key);
+void flight_land(const pycall_t& call, ring_queue<pycall_t>& backlog);
+
+unsigned int cache_entries();
+unsigned int cache_memory();
+
+}
+
+#endif
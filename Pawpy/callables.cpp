@@ -0,0 +1,339 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Every call used to import the module, append the working directory to
+		sys.path (so sys.path grew by one entry per call) and look the function
+		up by name before finally calling it. Now sys.path is set up once when
+		the plugin loads and resolved function objects are cached here, holding
+		strong references, until a script explicitly asks for a reload.
+
+		Everything in here except request_reload must be called with the GIL
+		held, the GIL is what protects the cache maps. Workers that run their
+		own subinterpreter (see pool.cpp) have their own GIL, so they also get
+		their own cache since module objects can't be shared between
+		interpreters. Everything else uses the shared cache.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::mutex;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "callables.hpp"
+#include "errors.hpp"
+
+
+/*
+	Note:
+	One entry per imported module. The module object itself is kept so it can
+	be passed to PyImport_ReloadModule later and the functions map holds every
+	function that has been resolved from it so far.
+*/
+struct module_entry_t
+{
+	PyObject* module;
+	map<string, PyObject*> functions;
+};
+
+/*
+	Note:
+	reloads_seen is how far into reload_log this cache has got, see below.
+*/
+struct callable_cache_t
+{
+	map<string, module_entry_t> modules;
+	size_t reloads_seen;
+};
+
+static callable_cache_t shared_cache = {{}, 0};
+static thread_local callable_cache_t* local_cache = nullptr;
+
+/*
+	Note:
+	Reloads are requested from the main thread but a cache can only be
+	touched while holding its interpreter's GIL. Rather than make the server
+	wait for the GIL, requests are appended to this log and each cache
+	catches up with it the next time it resolves a callable. An empty module
+	name means reload everything. Reloads are rare so the log is never
+	trimmed.
+*/
+static vector<string> reload_log;
+static mutex reload_mutex;
+static std::atomic<size_t> reload_count(0);
+
+
+static callable_cache_t& current_cache()
+{
+	return local_cache != nullptr ? *local_cache : shared_cache;
+}
+
+
+/*
+	Note:
+	This gets the "cwd" (current working directory) and appends it to the
+	Python module search path (sys.path) so that .py files in the SA:MP
+	server directory are found. Because of Python's module abstraction,
+	scripts in subdirectories are specified by . as the directory delimiter
+	instead of a / character. I was going to hard-code a ./scripts/
+	directory since most users would probably want their scripts organised
+	in some way but I'll leave that up to users to decide.
+*/
+void Pawpy::setup_sys_path()
+{
+	char* cwd = GETCWD(NULL, 0);
+
+	PyObject* sysPath = PySys_GetObject((char*)"path");
+	PyObject* programName = PyUnicode_FromString(cwd);
+	PyList_Append(sysPath, programName);
+	Py_DECREF(programName);
+
+	free(cwd);
+}
+
+static void drop_functions(module_entry_t& entry)
+{
+	for(auto& i : entry.functions)
+	{
+		Py_DECREF(i.second);
+	}
+
+	entry.functions.clear();
+}
+
+/*
+	Note:
+	Reloads a cached module in-place. If the reload fails (syntax error in the
+	new code for example) the old module object is kept so the functions will
+	be resolved from that again.
+*/
+static void reload_entry(const string& name, module_entry_t& entry)
+{
+	drop_functions(entry);
+
+	PyObject* reloaded = PyImport_ReloadModule(entry.module);
+
+	if(reloaded == nullptr)
+	{
+		Pawpy::error_report(name, Pawpy::name_t(), "Failed to reload module: '%s'", name.c_str());
+		return;
+	}
+
+	Py_DECREF(entry.module);
+	entry.module = reloaded;
+
+	debug("reload_entry: reloaded module '%s'", name.c_str());
+}
+
+static void process_reloads(callable_cache_t& cache)
+{
+	vector<string> pending;
+
+	{
+		std::lock_guard<std::mutex> lock(reload_mutex);
+		pending.assign(reload_log.begin() + cache.reloads_seen, reload_log.end());
+		cache.reloads_seen = reload_log.size();
+	}
+
+	for(auto& name : pending)
+	{
+		if(name.empty())
+		{
+			for(auto& i : cache.modules)
+			{
+				reload_entry(i.first, i.second);
+			}
+		}
+		else
+		{
+			auto it = cache.modules.find(name);
+
+			/*
+				Note:
+				Modules that were never imported don't need reloading, they'll
+				be imported fresh the first time they're used.
+			*/
+			if(it != cache.modules.end())
+				reload_entry(it->first, it->second);
+		}
+	}
+}
+
+/*
+	Note:
+	Returns the function object for module.function, importing the module and
+	looking up the attribute only the first time. The caller gets a new
+	reference: calling the function can release the GIL, and a reload handled
+	by another thread meanwhile drops the cache's reference, which could
+	otherwise free the function while it's still running. Failures are not
+	cached so a module that fails to import will be retried (and report its
+	error) on every call.
+*/
+PyObject* Pawpy::resolve_callable(const string& module, const string& function)
+{
+	callable_cache_t& cache = current_cache();
+
+	if(cache.reloads_seen != reload_count)
+		process_reloads(cache);
+
+	auto mod_it = cache.modules.find(module);
+
+	if(mod_it == cache.modules.end())
+	{
+		PyObject* module_ptr = PyImport_ImportModule(module.c_str());
+
+		if(module_ptr == nullptr)
+		{
+			error_report(module, function, "Failed to load module: '%s'", module.c_str());
+			return nullptr;
+		}
+
+		debug("resolve_callable: imported module '%s'", module.c_str());
+
+		module_entry_t entry;
+		entry.module = module_ptr;
+
+		/*
+			Note:
+			Importing can release the GIL, so another worker sharing this
+			cache may have imported the module in the meantime. Its entry is
+			kept and this reference dropped.
+		*/
+		auto inserted = cache.modules.insert(std::make_pair(module, entry));
+
+		if(!inserted.second)
+			Py_DECREF(module_ptr);
+
+		mod_it = inserted.first;
+	}
+
+	auto func_it = mod_it->second.functions.find(function);
+
+	if(func_it != mod_it->second.functions.end())
+	{
+		Py_INCREF(func_it->second);
+		return func_it->second;
+	}
+
+	PyObject* func_ptr = PyObject_GetAttrString(mod_it->second.module, function.c_str());
+
+	if(func_ptr == nullptr)
+	{
+		error_report(module, function, "Module '%s' has no attribute: '%s'", module.c_str(), function.c_str());
+		return nullptr;
+	}
+
+	/*
+		Note:
+		Checks if this is a "callable" object. Everything is an object in Python
+		so the "attribute" we loaded could actually be a class or a variable so
+		this check ensures it's something we can "call".
+	*/
+	if(!PyCallable_Check(func_ptr))
+	{
+		Py_DECREF(func_ptr);
+		error_report(module, function, "Function not found or is not callable: '%s'", function.c_str());
+		return nullptr;
+	}
+
+	debug("resolve_callable: resolved '%s.%s'", module.c_str(), function.c_str());
+
+	/*
+		Note:
+		Same as above, looking the attribute up can release the GIL too.
+	*/
+	auto inserted = mod_it->second.functions.insert(std::make_pair(function, func_ptr));
+
+	if(!inserted.second)
+	{
+		Py_DECREF(func_ptr);
+		func_ptr = inserted.first->second;
+	}
+
+	Py_INCREF(func_ptr);
+	return func_ptr;
+}
+
+/*
+	Note:
+	Asks for a module to be reloaded and its cached functions dropped. This is
+	the only thing that invalidates the cache. Safe to call without the GIL.
+*/
+void Pawpy::request_reload(string module)
+{
+	std::lock_guard<std::mutex> lock(reload_mutex);
+	reload_log.push_back(module);
+	reload_count = reload_log.size();
+}
+
+static void clear_cache(callable_cache_t& cache)
+{
+	for(auto& i : cache.modules)
+	{
+		drop_functions(i.second);
+		Py_DECREF(i.second.module);
+	}
+
+	cache.modules.clear();
+}
+
+/*
+	Note:
+	Releases every reference in the shared cache, called on shutdown before
+	the interpreter is finalised.
+*/
+void Pawpy::clear_callables()
+{
+	clear_cache(shared_cache);
+}
+
+/*
+	Note:
+	Gives the calling thread its own cache, used by workers that run their own
+	subinterpreter. Must be called with that interpreter's GIL held and ended
+	with end_local_callables before the interpreter is destroyed.
+*/
+void Pawpy::begin_local_callables()
+{
+	local_cache = new callable_cache_t();
+	local_cache->reloads_seen = reload_count;
+}
+
+void Pawpy::end_local_callables()
+{
+	if(local_cache == nullptr)
+		return;
+
+	clear_cache(*local_cache);
+	delete local_cache;
+	local_cache = nullptr;
+}
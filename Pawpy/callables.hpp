@@ -0,0 +1,54 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The resolved-callable cache. Modules are imported and functions looked
+		up once, after that the function objects are kept here and handed
+		straight to call_python. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_CALLABLES_H
+#define PAWPY_CALLABLES_H
+
+#include <string>
+
+using std::string;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+
+namespace Pawpy
+{
+
+void setup_sys_path();
+
+PyObject* resolve_callable(const string& module, const string& function);
+void request_reload(string module);
+void clear_callables();
+void begin_local_callables();
+void end_local_callables();
+
+}
+
+#endif
@@ -0,0 +1,463 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Every threaded call gets an ID when it's submitted, which is returned
+		to Pawn and passed to the callback. The call's state is kept here from
+		then until its callback has been called so scripts can check on it
+		with GetPythonCallStatus and drop it with CancelPythonCall, for
+		example when the player it was for disconnects.
+
+		States are set by the main thread, apart from queued to running which
+		a worker does when it picks the call up and the timeouts the watchdog
+		sets, so the table is protected by a mutex. It's only held for a table
+		lookup.
+
+
+==============================================================================*/
+
+
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+
+using std::vector;
+using std::mutex;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+#include <pythread.h>
+
+#include "callstate.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+/*
+	Note:
+	id is zero for an empty slot. timeout is in milliseconds, zero for none.
+	The rest is only set while a worker is inside Python for the call (see
+	call_bind) and tells the watchdog which thread to raise the timeout in.
+*/
+struct call_state_t
+{
+	cell id;
+	Pawpy::call_status_t status;
+	unsigned int timeout;
+	bool bound;
+	bool expired;
+	clock_type::time_point started;
+	unsigned long thread;
+	PyInterpreterState* interpreter;
+};
+
+/*
+	Note:
+	An open addressing table with linear probing. IDs are handed out in order
+	and most calls finish in about the order they were made, so a call almost
+	always sits in slot id & mask with no probing at all. The table doubles
+	when it's half full and is never shrunk, so once it's big enough for the
+	most calls a server has in flight at once it never allocates again.
+	bound_calls is the same, a plain list that's only as long as the number
+	of calls inside Python at once.
+*/
+static vector<call_state_t> call_states;
+static size_t call_states_used = 0;
+static vector<cell> bound_calls;
+static mutex call_states_mutex;
+
+/*
+	Note:
+	Only used by the main thread. IDs start at 1 so 0 can mean failure and
+	wrap back to 1 long before one could still be in use.
+*/
+static cell next_call_id = 1;
+
+
+static call_state_t* find_state(cell id)
+{
+	if(id == 0 || call_states.empty())
+		return nullptr;
+
+	size_t mask = call_states.size() - 1;
+
+	for(size_t i = id & mask;; i = (i + 1) & mask)
+	{
+		if(call_states[i].id == id)
+			return &call_states[i];
+
+		if(call_states[i].id == 0)
+			return nullptr;
+	}
+}
+
+static void insert_state(vector<call_state_t>& table, const call_state_t& state)
+{
+	size_t mask = table.size() - 1;
+	size_t i = state.id & mask;
+
+	while(table[i].id != 0)
+		i = (i + 1) & mask;
+
+	table[i] = state;
+}
+
+/*
+	Note:
+	Empties a slot and moves any entries after it that can't be found past
+	an empty slot back into it, so lookups never need tombstones.
+*/
+static void erase_state(call_state_t* state)
+{
+	size_t mask = call_states.size() - 1;
+	size_t hole = state - call_states.data();
+	size_t home;
+
+	for(size_t i = (hole + 1) & mask; call_states[i].id != 0; i = (i + 1) & mask)
+	{
+		home = call_states[i].id & mask;
+
+		if(((i - home) & mask) >= ((i - hole) & mask))
+		{
+			call_states[hole] = call_states[i];
+			hole = i;
+		}
+	}
+
+	call_states[hole].id = 0;
+	call_states_used--;
+}
+
+static void grow_states()
+{
+	vector<call_state_t> grown(call_states.empty() ? 1024 : call_states.size() * 2);
+
+	for(auto& state : grown)
+		state.id = 0;
+
+	for(auto& state : call_states)
+	{
+		if(state.id != 0)
+			insert_state(grown, state);
+	}
+
+	call_states.swap(grown);
+}
+
+
+/*
+	Note:
+	Gives a new call its ID, called from the main thread when the call is
+	submitted.
+*/
+cell Pawpy::call_register(call_status_t status, unsigned int timeout)
+{
+	cell id = next_call_id;
+
+	if(++next_call_id <= 0)
+		next_call_id = 1;
+
+	call_state_t state;
+	state.id = id;
+	state.status = status;
+	state.timeout = timeout;
+	state.bound = false;
+	state.expired = false;
+	state.thread = 0;
+	state.interpreter = nullptr;
+
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	if((call_states_used + 1) * 2 > call_states.size())
+		grow_states();
+
+	insert_state(call_states, state);
+	call_states_used++;
+
+	return id;
+}
+
+/*
+	Note:
+	Changes a call's timeout. A call that's already running is measured from
+	when it started, so a shorter timeout may expire it straight away.
+*/
+bool Pawpy::call_set_timeout(cell id, unsigned int timeout)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return false;
+
+	found->timeout = timeout;
+
+	return true;
+}
+
+/*
+	Note:
+	Called by a worker just before it runs a call. Returns false if the call
+	was cancelled while it was queued, the worker then either drops it and
+	forgets it or, if it has to run anyway, leaves it cancelled so its
+	callback is suppressed.
+*/
+bool Pawpy::call_start(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return true;
+
+	if(found->status == CALL_CANCELLED)
+		return false;
+
+	found->status = CALL_RUNNING;
+
+	return true;
+}
+
+/*
+	Note:
+	Called by a worker with the GIL held as it enters Python for a call, so
+	the watchdog can find the thread if the call runs past its timeout.
+	Returns the call's timeout.
+*/
+unsigned int Pawpy::call_bind(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return 0;
+
+	found->bound = true;
+	found->started = clock_type::now();
+	found->thread = PyThread_get_thread_ident();
+	found->interpreter = PyThreadState_Get()->interp;
+
+	bound_calls.push_back(id);
+
+	return found->timeout;
+}
+
+/*
+	Note:
+	Called by the worker, still holding the GIL, once it's done with the call.
+	The watchdog only raises a timeout while holding the same GIL and after
+	checking the call is still bound, so it can never hit whatever the worker
+	runs next. A timeout raised after the function's last line ran is still
+	pending in the thread though, so it's cleared here too. Returns true if
+	the call timed out.
+*/
+bool Pawpy::call_unbind(cell id)
+{
+	bool expired = false;
+
+	{
+		std::lock_guard<mutex> lock(call_states_mutex);
+
+		call_state_t* found = find_state(id);
+
+		if(found != nullptr)
+		{
+			found->bound = false;
+			expired = found->expired;
+		}
+
+		auto bound = std::find(bound_calls.begin(), bound_calls.end(), id);
+
+		if(bound != bound_calls.end())
+		{
+			*bound = bound_calls.back();
+			bound_calls.pop_back();
+		}
+	}
+
+	if(expired)
+		PyThreadState_SetAsyncExc(PyThread_get_thread_ident(), nullptr);
+
+	return expired;
+}
+
+/*
+	Note:
+	Called by the watchdog to find the running calls that have gone past
+	their timeout. Only calls currently inside Python are looked at, there's
+	never more of those than there are workers.
+*/
+void Pawpy::call_expired(vector<call_expired_t>& expired)
+{
+	clock_type::time_point now = clock_type::now();
+
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	for(cell id : bound_calls)
+	{
+		call_state_t* found = find_state(id);
+
+		if(found == nullptr)
+			continue;
+
+		call_state_t& state = *found;
+
+		if(state.timeout == 0 || state.expired)
+			continue;
+
+		if(now - state.started < std::chrono::milliseconds(state.timeout))
+			continue;
+
+		expired.push_back({id, state.thread, state.interpreter});
+	}
+}
+
+/*
+	Note:
+	Called by the watchdog with the GIL of the call's interpreter held. Marks
+	the call as timed out and returns true if it's still running on the same
+	thread, in which case the watchdog raises the timeout in it.
+*/
+bool Pawpy::call_expire(const call_expired_t& expired)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(expired.id);
+
+	if(found == nullptr)
+		return false;
+
+	call_state_t& state = *found;
+
+	if(!state.bound || state.expired || state.thread != expired.thread)
+		return false;
+
+	state.expired = true;
+
+	if(state.status != CALL_CANCELLED)
+		state.status = CALL_TIMED_OUT;
+
+	return true;
+}
+
+/*
+	Note:
+	Called as a finished call is collected from the workers. Returns false,
+	and forgets the call, if it was cancelled while it was running.
+*/
+bool Pawpy::call_finish(cell id, bool timed_out)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return true;
+
+	if(found->status == CALL_CANCELLED)
+	{
+		erase_state(found);
+		return false;
+	}
+
+	found->status = timed_out ? CALL_TIMED_OUT : CALL_DONE;
+
+	return true;
+}
+
+/*
+	Note:
+	Called by amx_tick just before a callback. Returns false, and forgets the
+	call, if it was cancelled and the callback must not be called. Otherwise
+	the call is kept until call_forget so the callback can still check its
+	status, that's how it tells a timeout from an ordinary failure.
+*/
+bool Pawpy::call_deliver(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return true;
+
+	if(found->status != CALL_CANCELLED)
+		return true;
+
+	erase_state(found);
+
+	return false;
+}
+
+void Pawpy::call_forget(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found != nullptr)
+		erase_state(found);
+}
+
+/*
+	Note:
+	Marks a call as cancelled so it won't be run if it hasn't started and its
+	callback won't be called. Returns false if there's no such call.
+*/
+bool Pawpy::call_cancel(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return false;
+
+	found->status = CALL_CANCELLED;
+
+	return true;
+}
+
+Pawpy::call_status_t Pawpy::call_status(cell id)
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+
+	call_state_t* found = find_state(id);
+
+	if(found == nullptr)
+		return CALL_NONE;
+
+	return found->status;
+}
+
+/*
+	Note:
+	Every call that has been submitted and whose callback hasn't been called
+	yet, whatever state it's in.
+*/
+size_t Pawpy::call_count()
+{
+	std::lock_guard<mutex> lock(call_states_mutex);
+	return call_states_used;
+}
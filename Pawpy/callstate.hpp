@@ -0,0 +1,88 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Call IDs and the state of every threaded call that hasn't been
+		delivered yet, so scripts can poll and cancel calls. See the .cpp for
+		details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_CALLSTATE_H
+#define PAWPY_CALLSTATE_H
+
+#include <vector>
+
+using std::vector;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+#include <amx/amx.h>
+
+
+namespace Pawpy
+{
+
+/*
+	Note:
+	These must match the PyCallStatus enumerator in pawpy.inc. CALL_NONE is
+	returned for IDs that don't exist or whose callback has already been
+	called.
+*/
+enum call_status_t
+{
+	CALL_NONE,
+	CALL_QUEUED,
+	CALL_RUNNING,
+	CALL_DONE,
+	CALL_CANCELLED,
+	CALL_TIMED_OUT
+};
+
+/*
+	Note:
+	A running call that has gone past its timeout, see watchdog.cpp.
+*/
+struct call_expired_t
+{
+	cell id;
+	unsigned long thread;
+	PyInterpreterState* interpreter;
+};
+
+cell call_register(call_status_t status, unsigned int timeout);
+bool call_set_timeout(cell id, unsigned int timeout);
+unsigned int call_bind(cell id);
+bool call_unbind(cell id);
+void call_expired(vector<call_expired_t>& expired);
+bool call_expire(const call_expired_t& expired);
+bool call_start(cell id);
+bool call_finish(cell id, bool timed_out);
+bool call_deliver(cell id);
+void call_forget(cell id);
+bool call_cancel(cell id);
+call_status_t call_status(cell id);
+size_t call_count();
+
+}
+
+#endif
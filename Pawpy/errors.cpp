@@ -0,0 +1,361 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		A broken function fails the same way on every call, and logging every
+		one of them buried the server log under thousands of identical
+		reports a minute. Errors are now grouped by the function that raised
+		them, the exception type, the line it was raised on and what the
+		plugin was doing at the time. The first of each is logged in full,
+		with the traceback as traceback.format_exception formats it, and then
+		nothing more for pawpy_error_interval seconds. Once that's up a single
+		line says how many more there were, and the next one is logged in
+		full again.
+
+		The traceback is formatted by the thread that caught the exception
+		while it still holds the GIL, only the finished text goes through the
+		log ring (see log.cpp) to the main thread. A repeat that isn't logged
+		costs a map lookup.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <mutex>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+using std::string;
+using std::map;
+using std::unordered_map;
+using std::mutex;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "errors.hpp"
+#include "settings.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+/*
+	Note:
+	The message is the format string the error was reported with, so errors
+	from different places in the plugin are kept apart even when there's no
+	exception to tell them apart by.
+*/
+typedef std::tuple<unsigned long long, const char*, string, int> error_key_t;
+
+struct error_entry_t
+{
+	Pawpy::name_t module;
+	Pawpy::name_t function;
+	clock_type::time_point window_end;
+	unsigned int suppressed;
+};
+
+static mutex errors_mutex;
+static map<error_key_t, error_entry_t> error_entries;
+static clock_type::time_point next_check;
+
+/*
+	Note:
+	Failed calls per function, only touched by the main thread.
+*/
+static unordered_map<unsigned long long, unsigned int> function_errors;
+
+
+/*
+	Note:
+	The line the exception was raised on, which is the last entry in the
+	traceback. The attributes are used rather than the struct since newer
+	versions work the line number out on demand.
+*/
+static int innermost_line(PyObject* trace)
+{
+	int line = 0;
+	PyObject* tb = trace;
+
+	Py_XINCREF(tb);
+
+	while(tb != nullptr && tb != Py_None)
+	{
+		PyObject* lineno = PyObject_GetAttrString(tb, "tb_lineno");
+
+		if(lineno != nullptr)
+		{
+			line = PyLong_AsLong(lineno);
+			Py_DECREF(lineno);
+		}
+
+		PyObject* next = PyObject_GetAttrString(tb, "tb_next");
+
+		Py_DECREF(tb);
+		tb = next;
+	}
+
+	Py_XDECREF(tb);
+	PyErr_Clear();
+
+	return line;
+}
+
+/*
+	Note:
+	Appends the exception as Python would print it. If the traceback module
+	can't do it for some reason the type and value are all that's given.
+*/
+static void format_exception(PyObject* type, PyObject* value, PyObject* trace, string& out)
+{
+	PyObject* traceback = PyImport_ImportModule("traceback");
+	PyObject* lines = nullptr;
+
+	if(traceback != nullptr)
+	{
+		lines = PyObject_CallMethod(traceback, "format_exception", "OOO", type, value == nullptr ? Py_None : value, trace == nullptr ? Py_None : trace);
+		Py_DECREF(traceback);
+	}
+
+	if(lines != nullptr && PyList_Check(lines))
+	{
+		for(Py_ssize_t i = 0; i < PyList_GET_SIZE(lines); ++i)
+		{
+			const char* line = PyUnicode_AsUTF8(PyList_GET_ITEM(lines, i));
+
+			if(line != nullptr)
+				out += line;
+		}
+
+		while(!out.empty() && out.back() == '\n')
+			out.pop_back();
+	}
+	else
+	{
+		PyObject* text = value == nullptr ? nullptr : PyObject_Str(value);
+		const char* ctext = text == nullptr ? nullptr : PyUnicode_AsUTF8(text);
+
+		out += reinterpret_cast<PyTypeObject*>(type)->tp_name;
+		out += ": ";
+		out += ctext == nullptr ? "(no message)" : ctext;
+
+		Py_XDECREF(text);
+	}
+
+	Py_XDECREF(lines);
+	PyErr_Clear();
+}
+
+/*
+	Note:
+	What the summary line calls an error, the key is unpacked again since
+	the entry only exists to hold the counts.
+*/
+static void describe(const error_key_t& key, const error_entry_t& entry, string& out)
+{
+	const string& type = std::get<2>(key);
+	char line[32];
+
+	if(type.empty())
+	{
+		out = "the error";
+	}
+	else
+	{
+		snprintf(line, sizeof(line), " (line %d)", std::get<3>(key));
+		out = type + line;
+	}
+
+	if(!entry.function.empty())
+		out += " from '" + entry.module.str() + "." + entry.function.str() + "'";
+}
+
+static void print_summary(const error_key_t& key, const error_entry_t& entry, unsigned int count)
+{
+	string description;
+
+	describe(key, entry, description);
+
+	samp_printf("Pawpy: %u more occurrences of %s in the last %us.", count, description.c_str(), Pawpy::settings.error_interval);
+}
+
+/*
+	Note:
+	Reports the Python exception that's currently set, if there is one,
+	along with a message about what failed and clears it. module and
+	function are the call the error happened in, they're empty for errors
+	that don't belong to a call. The caller must hold the GIL.
+*/
+void Pawpy::error_report(name_t module, name_t function, const char* message, ...)
+{
+	PyObject* type;
+	PyObject* value;
+	PyObject* trace;
+
+	PyErr_Fetch(&type, &value, &trace);
+
+	if(type != nullptr)
+	{
+		PyErr_NormalizeException(&type, &value, &trace);
+
+		if(value != nullptr && trace != nullptr)
+			PyException_SetTraceback(value, trace);
+	}
+
+	error_key_t key(
+		name_pair(module, function),
+		message,
+		type == nullptr ? string() : string(reinterpret_cast<PyTypeObject*>(type)->tp_name),
+		type == nullptr ? 0 : innermost_line(trace));
+
+	clock_type::time_point now = clock_type::now();
+	unsigned int summary = 0;
+	bool log = true;
+
+	{
+		std::lock_guard<mutex> lock(errors_mutex);
+
+		auto found = error_entries.find(key);
+
+		if(found == error_entries.end())
+		{
+			error_entry_t entry;
+			entry.module = module;
+			entry.function = function;
+			entry.suppressed = 0;
+
+			found = error_entries.insert(std::make_pair(key, entry)).first;
+		}
+		else if(settings.error_interval > 0 && now < found->second.window_end)
+		{
+			found->second.suppressed++;
+			log = false;
+		}
+
+		if(log)
+		{
+			summary = found->second.suppressed;
+			found->second.suppressed = 0;
+			found->second.window_end = now + std::chrono::seconds(settings.error_interval);
+
+			if(summary > 0)
+				print_summary(key, found->second, summary);
+		}
+	}
+
+	if(log)
+	{
+		string report = "ERROR: ";
+		char buffer[512];
+
+		if(message != nullptr)
+		{
+			va_list args;
+			va_start(args, message);
+			vsnprintf(buffer, sizeof(buffer), message, args);
+			va_end(args);
+
+			report += buffer;
+		}
+		else
+		{
+			report += "Python error";
+		}
+
+		if(type != nullptr)
+		{
+			report += "\n";
+			format_exception(type, value, trace, report);
+		}
+
+		samp_printf("%s", report.c_str());
+	}
+
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(trace);
+
+	/*
+		Note:
+		Formatting the exception can raise errors of its own, none of them
+		may be left set or the thread's next call would fail with them.
+	*/
+	PyErr_Clear();
+}
+
+/*
+	Note:
+	Called by collect_results for every result, counts the calls that failed
+	for a reason other than a timeout (those are counted by the metrics).
+	Results of worker processes are included this way, their errors are
+	reported in the process that ran them.
+*/
+void Pawpy::errors_result(const pycall_t& call)
+{
+	if(!call.failed || call.timed_out)
+		return;
+
+	function_errors[name_pair(call.module, call.function)]++;
+}
+
+unsigned int Pawpy::errors_count(name_t module, name_t function)
+{
+	auto found = function_errors.find(name_pair(module, function));
+
+	if(found == function_errors.end())
+		return 0;
+
+	return found->second;
+}
+
+/*
+	Note:
+	Called every ProcessTick, once a second it prints the summary of every
+	error whose interval has run out with repeats that weren't logged. The
+	next occurrence of one of them is logged in full again.
+*/
+void Pawpy::errors_tick()
+{
+	if(settings.error_interval == 0)
+		return;
+
+	clock_type::time_point now = clock_type::now();
+
+	if(now < next_check)
+		return;
+
+	next_check = now + std::chrono::seconds(1);
+
+	std::lock_guard<mutex> lock(errors_mutex);
+
+	for(auto& error : error_entries)
+	{
+		if(error.second.suppressed == 0 || now < error.second.window_end)
+			continue;
+
+		print_summary(error.first, error.second, error.second.suppressed);
+		error.second.suppressed = 0;
+	}
+}
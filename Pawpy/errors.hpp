@@ -0,0 +1,47 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Python error reporting. Repeats of the same error are counted instead
+		of logged, see the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_ERRORS_H
+#define PAWPY_ERRORS_H
+
+#include "main.hpp"
+#include "python_meta.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+void error_report(name_t module, name_t function, const char* message, ...);
+void errors_result(const pycall_t& call);
+unsigned int errors_count(name_t module, name_t function);
+void errors_tick();
+
+}
+
+#endif
@@ -0,0 +1,520 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Most calls are I/O-bound (HTTP lookups and the like) and spend nearly
+		all of their time waiting. Written as async def functions they can all
+		wait together on a single asyncio event loop rather than each holding
+		a worker thread for the whole round trip.
+
+		A worker calls the function as usual, which for an async def function
+		just creates a coroutine object. That's scheduled on the loop with
+		run_coroutine_threadsafe and the worker moves on to its next job. When
+		the coroutine finishes, a done callback on the loop thread converts
+		the result and pushes the call onto call_queue like a worker would.
+
+
+==============================================================================*/
+
+
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
+
+using std::thread;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "eventloop.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "errors.hpp"
+
+
+/*
+	Note:
+	inflight counts coroutines scheduled on the loop that haven't finished,
+	overflow counts coroutines that ran on a worker instead because the loop
+	already had max_inflight of them.
+*/
+std::atomic<unsigned int> Pawpy::loop_inflight(0);
+std::atomic<unsigned int> Pawpy::loop_inflight_peak(0);
+std::atomic<unsigned int> Pawpy::loop_overflow(0);
+
+static unsigned int loop_max_inflight = 0;
+static std::atomic<bool> loop_stopping(false);
+static thread loop_thread;
+
+/*
+	Note:
+	The loop and the asyncio functions used to talk to it. These are only set
+	while the loop thread is running and belong to the main interpreter.
+*/
+static PyInterpreterState* loop_interpreter = nullptr;
+static PyObject* loop = nullptr;
+static PyObject* run_coroutine_threadsafe = nullptr;
+static PyObject* wait_for = nullptr;
+static PyObject* timeout_error = nullptr;
+
+
+/*
+	Note:
+	The done callback added to every scheduled coroutine's future. self is a
+	capsule holding the call, which is moved out onto call_queue. It runs on
+	the loop thread with the GIL held.
+*/
+static PyObject* coroutine_done(PyObject* self, PyObject* future)
+{
+	Pawpy::pycall_t* call = static_cast<Pawpy::pycall_t*>(PyCapsule_GetPointer(self, "pawpy.pycall"));
+
+	Pawpy::loop_inflight--;
+
+	/*
+		Note:
+		Everything still running when the plugin unloads is cancelled, there's
+		nobody left to deliver those results to.
+	*/
+	if(call == nullptr || loop_stopping)
+		Py_RETURN_NONE;
+
+	PyObject* result = PyObject_CallMethod(future, "result", nullptr);
+
+	if(result == nullptr)
+	{
+		/*
+			Note:
+			Coroutines with a timeout are wrapped in asyncio.wait_for, which
+			cancels them and raises asyncio.TimeoutError when it runs out.
+		*/
+		if(call->timeout > 0 && PyErr_ExceptionMatches(timeout_error))
+		{
+			samp_printf("ERROR: Python coroutine '%s.%s' timed out after %dms.", call->module.c_str(), call->function.c_str(), call->timeout);
+			call->timed_out = true;
+		}
+
+		Pawpy::error_report(call->module, call->function, "Python coroutine '%s.%s' failed.", call->module.c_str(), call->function.c_str());
+	}
+
+	call->failed = !Pawpy::finish_python(result, *call);
+	call->timing.finished = std::chrono::steady_clock::now();
+
+	/*
+		Note:
+		Coroutines overlap on the loop thread so they're traced as async
+		spans rather than on the thread's own track.
+	*/
+	if(Pawpy::tracing())
+	{
+		Pawpy::trace_async("queued", call->module, call->function, call->id, call->timing.submitted, call->timing.dequeued);
+		Pawpy::trace_async("coroutine", call->module, call->function, call->id, call->timing.acquired, call->timing.finished);
+	}
+
+	Pawpy::metrics_execution(*call);
+	Pawpy::call_queue.push(std::move(*call));
+
+	/*
+		Note:
+		Errors have been reported by now, one left set here would be raised
+		inside the future's callback machinery instead.
+	*/
+	PyErr_Clear();
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef coroutine_done_def = {"pawpy_coroutine_done", coroutine_done, METH_O, nullptr};
+
+static void delete_call(PyObject* capsule)
+{
+	delete static_cast<Pawpy::pycall_t*>(PyCapsule_GetPointer(capsule, "pawpy.pycall"));
+}
+
+/*
+	Note:
+	Closes a coroutine that's about to be dropped without being awaited, so
+	Python doesn't warn that it was never awaited and a wait_for wrapper
+	lets go of the coroutine inside it. Closing one that has already
+	finished does nothing. An error that's already set is kept.
+*/
+static void close_coroutine(PyObject* coroutine)
+{
+	PyObject *type, *value, *traceback;
+	PyErr_Fetch(&type, &value, &traceback);
+
+	PyObject* result = PyObject_CallMethod(coroutine, "close", nullptr);
+	Py_XDECREF(result);
+	PyErr_Clear();
+
+	PyErr_Restore(type, value, traceback);
+}
+
+/*
+	Note:
+	Cancels whatever is still running on the loop and lets the cancellations
+	finish so the loop can be closed cleanly. asyncio.all_tasks is new in
+	3.7, before that it's a class method of Task (removed again in 3.9).
+*/
+static void cancel_tasks(PyObject* asyncio)
+{
+#if PY_VERSION_HEX >= 0x03070000
+	PyObject* tasks = PyObject_CallMethod(asyncio, "all_tasks", "O", loop);
+#else
+	PyObject* task_type = PyObject_GetAttrString(asyncio, "Task");
+	PyObject* tasks = task_type ? PyObject_CallMethod(task_type, "all_tasks", "O", loop) : nullptr;
+
+	Py_XDECREF(task_type);
+#endif
+	PyObject* pending = tasks ? PySequence_Tuple(tasks) : nullptr;
+	PyObject* gather = nullptr;
+	PyObject* kwargs = nullptr;
+	PyObject* result = nullptr;
+
+	Py_XDECREF(tasks);
+
+	if(pending == nullptr)
+	{
+		PyErr_Clear();
+		return;
+	}
+
+	for(Py_ssize_t i = 0; i < PyTuple_GET_SIZE(pending); ++i)
+	{
+		result = PyObject_CallMethod(PyTuple_GET_ITEM(pending, i), "cancel", nullptr);
+		Py_XDECREF(result);
+	}
+
+	gather = PyObject_GetAttrString(asyncio, "gather");
+	kwargs = Py_BuildValue("{s:O}", "return_exceptions", Py_True);
+
+	if(gather != nullptr && kwargs != nullptr)
+	{
+		PyObject* future = PyObject_Call(gather, pending, kwargs);
+
+		if(future != nullptr)
+		{
+			result = PyObject_CallMethod(loop, "run_until_complete", "O", future);
+			Py_XDECREF(result);
+			Py_DECREF(future);
+		}
+	}
+
+	PyErr_Clear();
+
+	Py_XDECREF(kwargs);
+	Py_XDECREF(gather);
+	Py_DECREF(pending);
+}
+
+/*
+	Note:
+	The body of the loop thread. It has its own thread state in the main
+	interpreter like a worker, sets up the loop, tells loop_start it's ready
+	then runs the loop until loop_stop stops it. The loop releases the GIL
+	whenever it's waiting so it doesn't get in the way of the workers.
+*/
+static void loop_body(std::promise<bool>* ready)
+{
+	PyThreadState* state = PyThreadState_New(loop_interpreter);
+
+	PyEval_RestoreThread(state);
+
+	PyObject* asyncio = PyImport_ImportModule("asyncio");
+
+	if(asyncio != nullptr)
+	{
+		loop = PyObject_CallMethod(asyncio, "new_event_loop", nullptr);
+		run_coroutine_threadsafe = PyObject_GetAttrString(asyncio, "run_coroutine_threadsafe");
+		wait_for = PyObject_GetAttrString(asyncio, "wait_for");
+		timeout_error = PyObject_GetAttrString(asyncio, "TimeoutError");
+	}
+
+	if(loop == nullptr || run_coroutine_threadsafe == nullptr || wait_for == nullptr || timeout_error == nullptr)
+	{
+		Pawpy::error_report(Pawpy::name_t(), Pawpy::name_t(), "Failed to create the asyncio event loop, coroutines will run on the workers.");
+
+		Py_CLEAR(loop);
+		Py_CLEAR(run_coroutine_threadsafe);
+		Py_CLEAR(wait_for);
+		Py_CLEAR(timeout_error);
+		Py_XDECREF(asyncio);
+
+		PyThreadState_Clear(state);
+		PyThreadState_DeleteCurrent();
+		ready->set_value(false);
+		return;
+	}
+
+	PyObject* result = PyObject_CallMethod(asyncio, "set_event_loop", "O", loop);
+	Py_XDECREF(result);
+
+	ready->set_value(true);
+
+	result = PyObject_CallMethod(loop, "run_forever", nullptr);
+
+	if(result == nullptr)
+		samp_pyerr();
+
+	Py_XDECREF(result);
+
+	cancel_tasks(asyncio);
+
+	result = PyObject_CallMethod(loop, "close", nullptr);
+	Py_XDECREF(result);
+	PyErr_Clear();
+
+	Py_CLEAR(loop);
+	Py_CLEAR(run_coroutine_threadsafe);
+	Py_CLEAR(wait_for);
+	Py_CLEAR(timeout_error);
+	Py_DECREF(asyncio);
+
+	PyThreadState_Clear(state);
+	PyThreadState_DeleteCurrent();
+}
+
+/*
+	Note:
+	Starts the loop thread, called from Load after the interpreter is ready
+	and the main thread has released the GIL. Zero disables the loop and every
+	coroutine is run on the worker that called it.
+*/
+void Pawpy::loop_start(unsigned int max_inflight)
+{
+	loop_max_inflight = max_inflight;
+
+	if(max_inflight == 0)
+		return;
+
+	loop_interpreter = PyInterpreterState_Head();
+	loop_stopping = false;
+
+	std::promise<bool> ready;
+	std::future<bool> started = ready.get_future();
+
+	loop_thread = thread(loop_body, &ready);
+
+	if(!started.get())
+	{
+		loop_thread.join();
+		loop_max_inflight = 0;
+	}
+}
+
+/*
+	Note:
+	Stops the loop and joins its thread. Must be called from the main thread
+	after the workers have been stopped, while the main thread doesn't hold
+	the GIL.
+*/
+void Pawpy::loop_stop()
+{
+	if(!loop_thread.joinable())
+		return;
+
+	loop_stopping = true;
+
+	PyEval_RestoreThread(main_thread_state);
+
+	PyObject* stop = PyObject_GetAttrString(loop, "stop");
+	PyObject* result = PyObject_CallMethod(loop, "call_soon_threadsafe", "O", stop);
+
+	if(result == nullptr)
+		samp_pyerr();
+
+	Py_XDECREF(result);
+	Py_XDECREF(stop);
+
+	main_thread_state = PyEval_SaveThread();
+
+	loop_thread.join();
+	loop_max_inflight = 0;
+}
+
+/*
+	Note:
+	Schedules a coroutine on the loop. Called by a worker with the GIL held.
+	On success the coroutine reference is taken over and the call is moved
+	into the done callback. Returns false without touching either when the
+	loop isn't running, the worker belongs to a subinterpreter (the loop only
+	exists in the main interpreter) or the in-flight limit has been reached,
+	the worker then runs the coroutine itself which also slows callers down
+	until the loop catches up.
+*/
+bool Pawpy::loop_submit(PyObject* coroutine, pycall_t& pycall)
+{
+	if(loop_max_inflight == 0 || PyThreadState_Get()->interp != loop_interpreter)
+		return false;
+
+	if(loop_inflight >= loop_max_inflight)
+	{
+		loop_overflow++;
+		return false;
+	}
+
+	/*
+		Note:
+		The watchdog can't raise a timeout inside a coroutine that's waiting
+		on the loop, asyncio.wait_for cancels it properly instead.
+	*/
+	PyObject* awaitable = coroutine;
+
+	if(pycall.timeout > 0)
+	{
+		awaitable = PyObject_CallFunction(wait_for, "Od", coroutine, pycall.timeout / 1000.0);
+
+		if(awaitable == nullptr)
+		{
+			samp_pyerr();
+			return false;
+		}
+	}
+	else
+	{
+		Py_INCREF(awaitable);
+	}
+
+	/*
+		Note:
+		The call lives in a capsule owned by the done callback so it's freed
+		along with the callback if the future never finishes. If anything
+		fails before the coroutine is scheduled, the call is moved back and
+		the wait_for wrapper is closed. The coroutine itself is left alone,
+		the worker runs it instead.
+	*/
+	pycall_t* call = new pycall_t(std::move(pycall));
+	PyObject* capsule = PyCapsule_New(call, "pawpy.pycall", delete_call);
+
+	if(capsule == nullptr)
+	{
+		samp_pyerr();
+		pycall = std::move(*call);
+		delete call;
+
+		if(awaitable != coroutine)
+			close_coroutine(awaitable);
+
+		Py_DECREF(awaitable);
+		return false;
+	}
+
+	PyObject* callback = PyCFunction_New(&coroutine_done_def, capsule);
+
+	if(callback == nullptr)
+	{
+		samp_pyerr();
+		pycall = std::move(*call);
+		Py_DECREF(capsule);
+
+		if(awaitable != coroutine)
+			close_coroutine(awaitable);
+
+		Py_DECREF(awaitable);
+		return false;
+	}
+
+	Py_DECREF(capsule);
+
+	PyObject* future = PyObject_CallFunctionObjArgs(run_coroutine_threadsafe, awaitable, loop, nullptr);
+
+	if(future == nullptr)
+	{
+		samp_pyerr();
+		pycall = std::move(*call);
+		Py_DECREF(callback);
+
+		if(awaitable != coroutine)
+			close_coroutine(awaitable);
+
+		Py_DECREF(awaitable);
+		return false;
+	}
+
+	Py_DECREF(awaitable);
+
+	unsigned int inflight = ++loop_inflight;
+
+	if(inflight > loop_inflight_peak)
+		loop_inflight_peak = inflight;
+
+	PyObject* result = PyObject_CallMethod(future, "add_done_callback", "O", callback);
+
+	if(result == nullptr)
+		samp_pyerr();
+
+	Py_XDECREF(result);
+	Py_DECREF(callback);
+	Py_DECREF(future);
+	Py_DECREF(coroutine);
+
+	return true;
+}
+
+/*
+	Note:
+	Runs a coroutine to completion on the calling thread with asyncio.run and
+	returns its result. Steals the coroutine reference and must be called
+	with the GIL held. asyncio.run is new in 3.7, before that the coroutine
+	is run on a fresh loop that's closed afterwards, which is the core of
+	what asyncio.run does. If it couldn't be run at all it's closed rather
+	than dropped.
+*/
+PyObject* Pawpy::run_coroutine(PyObject* coroutine)
+{
+	PyObject* asyncio = PyImport_ImportModule("asyncio");
+
+	if(asyncio == nullptr)
+	{
+		close_coroutine(coroutine);
+		Py_DECREF(coroutine);
+		return nullptr;
+	}
+
+#if PY_VERSION_HEX >= 0x03070000
+	PyObject* result = PyObject_CallMethod(asyncio, "run", "O", coroutine);
+#else
+	PyObject* result = nullptr;
+	PyObject* fresh = PyObject_CallMethod(asyncio, "new_event_loop", nullptr);
+
+	if(fresh != nullptr)
+	{
+		result = PyObject_CallMethod(fresh, "run_until_complete", "O", coroutine);
+
+		PyObject *type, *value, *traceback;
+		PyErr_Fetch(&type, &value, &traceback);
+
+		PyObject* closed = PyObject_CallMethod(fresh, "close", nullptr);
+		Py_XDECREF(closed);
+		PyErr_Clear();
+
+		PyErr_Restore(type, value, traceback);
+		Py_DECREF(fresh);
+	}
+#endif
+
+	if(result == nullptr)
+		close_coroutine(coroutine);
+
+	Py_DECREF(asyncio);
+	Py_DECREF(coroutine);
+
+	return result;
+}
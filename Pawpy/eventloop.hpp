@@ -0,0 +1,54 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The asyncio event loop. async def functions called from the worker
+		threads are run here, on one dedicated thread, instead of tying up a
+		worker for the whole call. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_EVENTLOOP_H
+#define PAWPY_EVENTLOOP_H
+
+#include <atomic>
+
+#include "main.hpp"
+#include "python_meta.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+extern std::atomic<unsigned int> loop_inflight;
+extern std::atomic<unsigned int> loop_inflight_peak;
+extern std::atomic<unsigned int> loop_overflow;
+
+void loop_start(unsigned int max_inflight);
+void loop_stop();
+bool loop_submit(PyObject* coroutine, pycall_t& pycall);
+PyObject* run_coroutine(PyObject* coroutine);
+
+}
+
+#endif
@@ -0,0 +1,265 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		samp_printf used to format into a new 256 byte buffer it never freed,
+		cut off anything longer and call logprintf from whatever thread it
+		was called on, so every worker logging an error at once leaked and
+		fought over the server's log.
+
+		Now each thread formats into a buffer of its own that's kept for the
+		thread's whole life and only grows when a longer message comes along.
+		The main thread writes to the log directly, every other thread copies
+		the message into a fixed ring of slots which the main thread empties
+		into the log every tick. Taking slots is a single compare-and-swap,
+		nothing waits and nothing is allocated. When the ring is full the
+		message is dropped and counted instead, the count is reported in the
+		log once there's room again.
+
+
+==============================================================================*/
+
+
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+
+using std::vector;
+
+#include "main.hpp"
+
+#include "log.hpp"
+
+
+std::atomic<unsigned int> Pawpy::log_dropped(0);
+
+/*
+	Note:
+	A message longer than one slot takes as many consecutive slots as it
+	needs, more is set on every slot but its last. Anything longer than
+	LOG_MESSAGE_SLOTS slots (far longer than any sensible log line) is cut
+	short and ends in "[...]" rather than wrapping the whole ring.
+*/
+static const size_t LOG_RING_SIZE = 1024;
+static const size_t LOG_SLOT_TEXT = 500;
+static const size_t LOG_MESSAGE_SLOTS = 64;
+static const size_t LOG_MESSAGE_MAX = LOG_MESSAGE_SLOTS * LOG_SLOT_TEXT;
+
+struct log_slot_t
+{
+	std::atomic<size_t> sequence;
+	unsigned short length;
+	bool more;
+	char text[LOG_SLOT_TEXT];
+};
+
+/*
+	Note:
+	A bounded queue in the style of Dmitry Vyukov's: a slot at position p is
+	free for writing when its sequence is p, holds a message once it's p + 1
+	and becomes free for position p + LOG_RING_SIZE when the main thread has
+	read it. tail is shared by the writers, head belongs to the main thread.
+*/
+static log_slot_t log_ring[LOG_RING_SIZE];
+static std::atomic<size_t> log_tail(0);
+static size_t log_head = 0;
+static std::atomic<bool> log_running(false);
+static unsigned int log_dropped_reported = 0;
+
+/*
+	Note:
+	Set only on the main thread by log_start, forked worker processes inherit
+	it and keep writing straight to the log like before.
+*/
+static thread_local bool log_main_thread = false;
+static thread_local vector<char> format_buffer;
+
+/*
+	Note:
+	Where the main thread puts a message back together from its slots, kept
+	between ticks since the rest of a message may not have been written yet.
+*/
+static vector<char> drain_buffer;
+
+
+void Pawpy::log_start()
+{
+	for(size_t i = 0; i < LOG_RING_SIZE; ++i)
+		log_ring[i].sequence.store(i, std::memory_order_relaxed);
+
+	log_tail = 0;
+	log_head = 0;
+	log_main_thread = true;
+	drain_buffer.reserve(LOG_SLOT_TEXT * 4);
+
+	log_running = true;
+}
+
+/*
+	Note:
+	Called from Unload once every other thread has stopped, whatever is left
+	in the ring is written out and from then on every message goes straight
+	to the log.
+*/
+void Pawpy::log_stop()
+{
+	log_drain();
+	log_running = false;
+}
+
+/*
+	Note:
+	Copies a message into the ring. The slots are claimed all at once so the
+	pieces of one message are never split up by another thread's. Claiming
+	the last one is enough, the main thread frees slots in order so every
+	slot before a free one is free too.
+*/
+static void log_push(const char* text, size_t length)
+{
+	size_t count = length == 0 ? 1 : (length + LOG_SLOT_TEXT - 1) / LOG_SLOT_TEXT;
+	size_t position = log_tail.load(std::memory_order_relaxed);
+
+	for(;;)
+	{
+		size_t last = position + count - 1;
+		size_t sequence = log_ring[last % LOG_RING_SIZE].sequence.load(std::memory_order_acquire);
+		intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(last);
+
+		if(difference == 0)
+		{
+			if(log_tail.compare_exchange_weak(position, position + count, std::memory_order_relaxed))
+				break;
+		}
+		else if(difference < 0)
+		{
+			Pawpy::log_dropped++;
+			return;
+		}
+		else
+		{
+			position = log_tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	for(size_t i = 0; i < count; ++i)
+	{
+		log_slot_t& slot = log_ring[(position + i) % LOG_RING_SIZE];
+		size_t size = length < LOG_SLOT_TEXT ? length : LOG_SLOT_TEXT;
+
+		memcpy(slot.text, text, size);
+		slot.length = size;
+		slot.more = i + 1 < count;
+		slot.sequence.store(position + i + 1, std::memory_order_release);
+
+		text += size;
+		length -= size;
+	}
+}
+
+/*
+	Note:
+	Formats a message and sends it to the log, for samp_printf. The format
+	buffer starts at a size that fits nearly everything, a longer message
+	grows it once and the thread keeps the bigger buffer. vsnprintf (rather
+	than VSPRINTF) is used since it reports how long the message really was.
+*/
+void Pawpy::log_format(const char* message, va_list args)
+{
+	if(format_buffer.empty())
+		format_buffer.resize(LOG_SLOT_TEXT);
+
+	va_list retry;
+	va_copy(retry, args);
+
+	int length = vsnprintf(format_buffer.data(), format_buffer.size(), message, args);
+
+	if(length < 0)
+	{
+		va_end(retry);
+		return;
+	}
+
+	if(static_cast<size_t>(length) >= format_buffer.size())
+	{
+		format_buffer.resize(length + 1);
+		vsnprintf(format_buffer.data(), format_buffer.size(), message, retry);
+	}
+
+	va_end(retry);
+
+	if(log_main_thread || !log_running)
+	{
+		if(log_running)
+			log_drain();
+
+		logprintf("%s", format_buffer.data());
+		return;
+	}
+
+	if(static_cast<size_t>(length) > LOG_MESSAGE_MAX)
+	{
+		length = LOG_MESSAGE_MAX;
+		memcpy(format_buffer.data() + length - 5, "[...]", 5);
+	}
+
+	log_push(format_buffer.data(), length);
+}
+
+/*
+	Note:
+	Writes everything in the ring to the log, called every ProcessTick and
+	before the main thread logs anything itself so messages keep their order
+	as far as possible. Stops at a slot that's been claimed but not written
+	yet, the rest is picked up next time.
+*/
+void Pawpy::log_drain()
+{
+	for(;;)
+	{
+		log_slot_t& slot = log_ring[log_head % LOG_RING_SIZE];
+
+		if(slot.sequence.load(std::memory_order_acquire) != log_head + 1)
+			break;
+
+		drain_buffer.insert(drain_buffer.end(), slot.text, slot.text + slot.length);
+
+		bool more = slot.more;
+
+		slot.sequence.store(log_head + LOG_RING_SIZE, std::memory_order_release);
+		log_head++;
+
+		if(more)
+			continue;
+
+		drain_buffer.push_back('\0');
+		logprintf("%s", drain_buffer.data());
+		drain_buffer.clear();
+	}
+
+	unsigned int dropped = log_dropped.load(std::memory_order_relaxed);
+
+	if(dropped != log_dropped_reported)
+	{
+		logprintf("Pawpy: %u log messages were dropped, the log ring was full.", dropped - log_dropped_reported);
+		log_dropped_reported = dropped;
+	}
+}
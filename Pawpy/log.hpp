@@ -0,0 +1,51 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The log ring. Messages from any thread other than the server's main
+		thread are queued here and written to the server log by the main
+		thread. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_LOG_H
+#define PAWPY_LOG_H
+
+#include <atomic>
+#include <cstdarg>
+
+#include "main.hpp"
+
+
+namespace Pawpy
+{
+
+extern std::atomic<unsigned int> log_dropped;
+
+void log_start();
+void log_stop();
+void log_format(const char* message, va_list args);
+void log_drain();
+
+}
+
+#endif
@@ -33,6 +33,7 @@
 
 // platform includes
 #include <set>
+#include <chrono>
 
 using std::set;
 
@@ -44,6 +45,19 @@ using std::set;
 // project related
 #include "natives.hpp"
 #include "pawpy.hpp"
+#include "pool.hpp"
+#include "callables.hpp"
+#include "settings.hpp"
+#include "process.hpp"
+#include "eventloop.hpp"
+#include "cache.hpp"
+#include "watchdog.hpp"
+#include "metrics.hpp"
+#include "pymodule.hpp"
+#include "records.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+#include "errors.hpp"
 
 
 /*==============================================================================
@@ -71,6 +85,8 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData)
 {
 	pAMXFunctions = ppData[PLUGIN_DATA_AMX_EXPORTS];
 	logprintf = (logprintf_t)ppData[PLUGIN_DATA_LOGPRINTF];
+
+	Pawpy::log_start();
 	
 	/*
 		Note:
@@ -79,13 +95,34 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData)
 		to release the interpreter lock since this thread isn't actually doing
 		any Python work, it will be delegated to worker threads later.
 	*/
+	Pawpy::load_settings("server.cfg");
+	Pawpy::module_register();
+
+	/*
+		Note:
+		Worker processes are forked before Python is initialised or any
+		threads exist, a forked copy of the server can't safely do either.
+	*/
+	Pawpy::process_start(Pawpy::settings.processes);
+
 	Py_SetProgramName(L"Pawpy");
 	Py_Initialize();
 	PyEval_InitThreads();
-	PyEval_SaveThread();
+	Pawpy::setup_sys_path();
+	Pawpy::main_thread_state = PyEval_SaveThread();
+
+	Pawpy::record_reserve(Pawpy::settings.queue_depth);
+	Pawpy::cache_start(Pawpy::settings.cache_entries);
+	Pawpy::loop_start(Pawpy::settings.async_inflight);
+	Pawpy::pool_start(Pawpy::settings.workers, Pawpy::settings.queue_depth);
+	Pawpy::watchdog_start();
 
 	samp_printf("\n");
 	samp_printf("Pawpy - Python utility for Pawn by Southclaw");
+	samp_printf("Pawpy: %d worker threads, job queue depth %d, tick budget %dus", Pawpy::pool_workers, Pawpy::pool_queue_depth, Pawpy::settings.tick_budget);
+
+	if(Pawpy::process_enabled())
+		samp_printf("Pawpy: threaded calls run in %d worker processes", Pawpy::process_count());
 	samp_printf("\n");
 
 	return true;
@@ -96,9 +133,22 @@ PLUGIN_EXPORT void PLUGIN_CALL Unload()
 	/*
 		Note:
 		Must be called on shutdown to gracefully close the Python interpreter.
+		The workers are stopped first and the main thread takes the GIL back
+		since Py_Finalize must be called with it held. A trace that's still
+		running is finished last, once nothing else can add to it.
 	*/
+	Pawpy::watchdog_stop();
+	Pawpy::pool_stop();
+	Pawpy::loop_stop();
+	Pawpy::process_stop();
+	Pawpy::log_stop();
+
+	PyEval_RestoreThread(Pawpy::main_thread_state);
+	Pawpy::clear_callables();
 	Py_Finalize();
 
+	Pawpy::trace_shutdown();
+
 	samp_printf("Pawpy unloaded.");
 }
 
@@ -106,90 +156,65 @@ PLUGIN_EXPORT void PLUGIN_CALL Unload()
 	Note:
 	The ProcessTick function is called from the SA:MP server every time it
 	completes (or starts, I forgot) an internal cycle of the main loop. So in
-	this plugin, we loop over all the AMX instances and call amx_tick for each.
-	There may be a better way to do this which I will experiment with in future.
+	this plugin, finished calls are collected and sorted by the AMX that made
+	them, then we loop over all the AMX instances and call amx_tick for each to
+	deliver its own results.
+
+	The deadline is shared by all AMX instances so the whole tick stays within
+	the pawpy_tick_budget setting.
 */
 PLUGIN_EXPORT void PLUGIN_CALL ProcessTick()
 {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+	if(Pawpy::settings.tick_budget > 0)
+		deadline = start + std::chrono::microseconds(Pawpy::settings.tick_budget);
+
+	Pawpy::collect_results();
+	Pawpy::metrics_tick();
+	Pawpy::errors_tick();
+
 	for(auto i : amx_list)
 	{
-		Pawpy::amx_tick(i);
+		Pawpy::amx_tick(i, deadline);
 	}
+
+	Pawpy::log_drain();
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	Pawpy::tick_time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+	if(Pawpy::tick_time > Pawpy::tick_time_peak)
+		Pawpy::tick_time_peak = Pawpy::tick_time;
+
+	if(Pawpy::tracing())
+		Pawpy::trace_span("ProcessTick", Pawpy::name_t(), Pawpy::name_t(), 0, start, end);
 }
 
+/*
+	Note:
+	Safe to call from any thread, see log.cpp.
+*/
 void samp_printf(const char* message, ...)
 {
-	unsigned int len = 256;
-	char* result = new char[len];
-
 	va_list args;
 	va_start(args, message);
 
-	VSPRINTF(result, len, message, args);
-	logprintf(result);
+	Pawpy::log_format(message, args);
 
 	va_end(args);
 }
 
 /*
 	Note:
-	Python string conversion is a ball-ache.
+	Reports the Python error that's currently set, for errors that don't
+	belong to a call. See errors.cpp.
 */
 void samp_pyerr()
 {
-	PyObject* type;
-	PyObject* value;
-	PyObject* trace;
-	PyObject* result;
-	char* ctype = nullptr;
-	char* cvalue = nullptr;
-	char* ctrace = nullptr;
-
-	PyErr_Fetch(&type, &value, &trace);
-
-	if(type != nullptr)
-	{
-		result = PyUnicode_AsEncodedString(type, "ASCII", "strict");
-
-		if(result != nullptr)
-		{
-			ctype = PyBytes_AS_STRING(result);
-			ctype = STRDUP(ctype);
-			Py_DECREF(result);
-		}
-	}
-
-	if(value != nullptr)
-	{
-		result = PyUnicode_AsEncodedString(value, "ASCII", "strict");
-
-		if(result != nullptr)
-		{
-			cvalue = PyBytes_AS_STRING(result);
-			cvalue = STRDUP(cvalue);
-			Py_DECREF(result);
-		}
-	}
-
-	if(trace != nullptr)
-	{
-		result = PyUnicode_AsEncodedString(trace, "ASCII", "strict");
-
-		if(result != nullptr)
-		{
-			ctrace = PyBytes_AS_STRING(result);
-			ctrace = STRDUP(ctrace);
-			Py_DECREF(result);
-		}
-	}
-
-	samp_printf("");
-	samp_printf("-- Python error report --");
-	samp_printf(ctype == nullptr ? "no ctype" : ctype);
-	samp_printf(cvalue == nullptr ? "no cvalue" : cvalue);
-	samp_printf(ctrace == nullptr ? "no ctrace" : ctrace);
-	samp_printf("-- End of error report --");
-	samp_printf("");
+	Pawpy::error_report(Pawpy::name_t(), Pawpy::name_t(), nullptr);
 }
 
 
@@ -215,18 +240,43 @@ extern "C" const AMX_NATIVE_INFO native_list[] =
 {
 	{"RunPython", Native::RunPython},
 	{"RunPythonThreaded", Native::RunPythonThreaded},
+	{"RunPythonThreadedEx", Native::RunPythonThreadedEx},
+	{"CancelPythonCall", Native::CancelPythonCall},
+	{"GetPythonCallStatus", Native::GetPythonCallStatus},
+	{"SetPythonTimeout", Native::SetPythonTimeout},
+	{"SetPythonCallTimeout", Native::SetPythonCallTimeout},
+	{"GetPythonTimeouts", Native::GetPythonTimeouts},
+	{"GetPythonErrors", Native::GetPythonErrors},
+	{"GetPythonStats", Native::GetPythonStats},
+	{"ReloadPythonModule", Native::ReloadPythonModule},
+	{"GetPythonStat", Native::GetPythonStat},
+	{"RunPythonBatch", Native::RunPythonBatch},
+	{"PyBatchBegin", Native::PyBatchBegin},
+	{"PyBatchAdd", Native::PyBatchAdd},
+	{"PyBatchSubmit", Native::PyBatchSubmit},
+	{"SetPythonCacheTTL", Native::SetPythonCacheTTL},
+	{"SetPythonCoalesce", Native::SetPythonCoalesce},
+	{"SetPythonCallbackBatched", Native::SetPythonCallbackBatched},
+	{"PreparePythonCall", Native::PreparePythonCall},
+	{"RunPreparedCall", Native::RunPreparedCall},
+	{"FreePreparedCall", Native::FreePreparedCall},
+	{"StartPythonTrace", Native::StartPythonTrace},
+	{"StopPythonTrace", Native::StopPythonTrace},
 	{NULL, NULL}
 };
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) 
 {
 	amx_list.insert(amx);
+	Pawpy::amx_load(amx);
 	return amx_Register(amx, native_list, -1);
 }
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX *amx) 
 {
 	amx_list.erase(amx);
+	Pawpy::amx_unload(amx);
+	Native::amx_unload(amx);
 	return AMX_ERR_NONE;
 }
 
@@ -0,0 +1,390 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Every thread that records metrics (the workers, the event loop and the
+		main thread) has its own table, so recording never waits for another
+		thread. Each table still has a mutex but the only other thread that
+		ever takes it is one reading the stats, which merges every table into
+		one view. Tables outlive their threads so nothing recorded is lost.
+
+		Latencies go into log-linear histograms: four buckets per power of
+		two microseconds, so a percentile is never more than 25% off. That's
+		precise enough to tell a slow function from a fast one, and a
+		histogram is a fixed size and cheap to add and merge.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::unordered_map;
+using std::mutex;
+
+#include "main.hpp"
+
+#include "metrics.hpp"
+#include "settings.hpp"
+#include "pool.hpp"
+#include "callstate.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+/*
+	Note:
+	Values under 4us get a bucket each, after that every power of two is
+	split into four. The last bucket holds everything from about 4.5 minutes.
+*/
+static const unsigned int HISTOGRAM_OCTAVES = 28;
+static const unsigned int HISTOGRAM_BUCKETS = (HISTOGRAM_OCTAVES + 1) * 4;
+
+struct histogram_t
+{
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+};
+
+struct function_metrics_t
+{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t timeouts;
+	histogram_t latency[Pawpy::METRIC_COUNT];
+};
+
+/*
+	Note:
+	Keyed by module then function so recording doesn't have to build a
+	string for every call.
+*/
+struct metrics_table_t
+{
+	mutex lock;
+	unordered_map<string, unordered_map<string, function_metrics_t>> modules;
+};
+
+static vector<std::shared_ptr<metrics_table_t>> metrics_tables;
+static mutex metrics_tables_mutex;
+static thread_local metrics_table_t* local_table = nullptr;
+
+static clock_type::time_point next_summary;
+
+
+static unsigned int bucket_of(uint64_t us)
+{
+	if(us < 4)
+		return static_cast<unsigned int>(us);
+
+	unsigned int octave = 2;
+
+	while(octave < HISTOGRAM_OCTAVES && (us >> (octave + 1)) != 0)
+		octave++;
+
+	if((us >> (octave + 1)) != 0)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return octave * 4 + ((us >> (octave - 2)) & 3);
+}
+
+/*
+	Note:
+	The largest value that lands in a bucket, that's what percentiles report.
+*/
+static uint64_t bucket_limit(unsigned int bucket)
+{
+	if(bucket < 4)
+		return bucket;
+
+	unsigned int octave = bucket / 4;
+
+	return ((static_cast<uint64_t>(5 + bucket % 4)) << (octave - 2)) - 1;
+}
+
+static void histogram_add(histogram_t& histogram, clock_type::duration duration)
+{
+	int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+
+	histogram.buckets[bucket_of(us < 0 ? 0 : us)]++;
+	histogram.count++;
+}
+
+static void histogram_merge(histogram_t& into, const histogram_t& from)
+{
+	for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		into.buckets[i] += from.buckets[i];
+
+	into.count += from.count;
+}
+
+static unsigned int histogram_percentile(const histogram_t& histogram, unsigned int percentile)
+{
+	if(histogram.count == 0)
+		return 0;
+
+	uint64_t target = (histogram.count * percentile + 99) / 100;
+	uint64_t seen = 0;
+
+	for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += histogram.buckets[i];
+
+		if(seen >= target)
+			return static_cast<unsigned int>(bucket_limit(i));
+	}
+
+	return static_cast<unsigned int>(bucket_limit(HISTOGRAM_BUCKETS - 1));
+}
+
+/*
+	Note:
+	Returns the calling thread's entry for a function, creating the table
+	the first time a thread records anything. The table's lock must be held.
+*/
+static metrics_table_t& thread_table()
+{
+	if(local_table == nullptr)
+	{
+		std::shared_ptr<metrics_table_t> table = std::make_shared<metrics_table_t>();
+
+		std::lock_guard<mutex> lock(metrics_tables_mutex);
+		metrics_tables.push_back(table);
+		local_table = table.get();
+	}
+
+	return *local_table;
+}
+
+static function_metrics_t& function_entry(metrics_table_t& table, const string& module, const string& function)
+{
+	auto& functions = table.modules[module];
+	auto found = functions.find(function);
+
+	if(found != functions.end())
+		return found->second;
+
+	function_metrics_t& entry = functions[function];
+	memset(&entry, 0, sizeof(entry));
+
+	return entry;
+}
+
+/*
+	Note:
+	Called by whichever thread ran the call, once it has finished running.
+*/
+void Pawpy::metrics_execution(const pycall_t& call)
+{
+	metrics_table_t& table = thread_table();
+	std::lock_guard<mutex> lock(table.lock);
+
+	function_metrics_t& entry = function_entry(table, call.module, call.function);
+
+	histogram_add(entry.latency[METRIC_QUEUE], call.timing.dequeued - call.timing.submitted);
+
+	if(call.timing.acquired != clock_type::time_point())
+	{
+		histogram_add(entry.latency[METRIC_GIL], call.timing.acquired - call.timing.dequeued);
+		histogram_add(entry.latency[METRIC_EXECUTION], call.timing.finished - call.timing.acquired);
+	}
+}
+
+/*
+	Note:
+	Called by collect_results for every result, including cached ones and
+	calls that shared another call's result, so calls is every call that
+	finished whether or not it actually ran.
+*/
+void Pawpy::metrics_result(const pycall_t& call)
+{
+	metrics_table_t& table = thread_table();
+	std::lock_guard<mutex> lock(table.lock);
+
+	function_metrics_t& entry = function_entry(table, call.module, call.function);
+
+	entry.calls++;
+
+	if(call.failed)
+		entry.errors++;
+
+	if(call.timed_out && call.timeout > 0)
+		entry.timeouts++;
+}
+
+/*
+	Note:
+	Called by amx_tick just before a callback.
+*/
+void Pawpy::metrics_delivery(const pycall_t& call)
+{
+	metrics_table_t& table = thread_table();
+	std::lock_guard<mutex> lock(table.lock);
+
+	function_metrics_t& entry = function_entry(table, call.module, call.function);
+
+	histogram_add(entry.latency[METRIC_DELIVERY], clock_type::now() - call.timing.finished);
+}
+
+static void merge_function(const function_metrics_t& from, function_metrics_t& into)
+{
+	into.calls += from.calls;
+	into.errors += from.errors;
+	into.timeouts += from.timeouts;
+
+	for(int i = 0; i < Pawpy::METRIC_COUNT; ++i)
+		histogram_merge(into.latency[i], from.latency[i]);
+}
+
+static void summarise(const function_metrics_t& metrics, Pawpy::function_stats_t& stats)
+{
+	static const unsigned int percentiles[3] = {50, 95, 99};
+
+	stats.calls = metrics.calls;
+	stats.errors = metrics.errors;
+	stats.timeouts = metrics.timeouts;
+
+	for(int i = 0; i < Pawpy::METRIC_COUNT; ++i)
+	{
+		for(int j = 0; j < 3; ++j)
+			stats.latency[i][j] = histogram_percentile(metrics.latency[i], percentiles[j]);
+	}
+}
+
+/*
+	Note:
+	Merges every thread's table into one map keyed by "module.function".
+	The caller may hold the GIL, nothing holding a table lock ever waits for
+	it.
+*/
+static void merge_tables(map<string, function_metrics_t>& merged)
+{
+	vector<std::shared_ptr<metrics_table_t>> tables;
+
+	{
+		std::lock_guard<mutex> lock(metrics_tables_mutex);
+		tables = metrics_tables;
+	}
+
+	for(auto& table : tables)
+	{
+		std::lock_guard<mutex> lock(table->lock);
+
+		for(auto& module : table->modules)
+		{
+			for(auto& function : module.second)
+			{
+				string name = module.first + "." + function.first;
+				auto found = merged.find(name);
+
+				if(found == merged.end())
+				{
+					found = merged.insert(std::make_pair(name, function_metrics_t())).first;
+					memset(&found->second, 0, sizeof(function_metrics_t));
+				}
+
+				merge_function(function.second, found->second);
+			}
+		}
+	}
+}
+
+bool Pawpy::metrics_get(const string& module, const string& function, function_stats_t& stats)
+{
+	map<string, function_metrics_t> merged;
+
+	merge_tables(merged);
+
+	auto found = merged.find(module + "." + function);
+
+	if(found == merged.end())
+		return false;
+
+	summarise(found->second, stats);
+
+	return true;
+}
+
+void Pawpy::metrics_all(map<string, function_stats_t>& stats)
+{
+	map<string, function_metrics_t> merged;
+
+	merge_tables(merged);
+
+	for(auto& function : merged)
+		summarise(function.second, stats[function.first]);
+}
+
+/*
+	Note:
+	Called every ProcessTick, prints one line summing every function once
+	every pawpy_stats_interval seconds. Everything is counted from when the
+	server started.
+*/
+void Pawpy::metrics_tick()
+{
+	if(settings.stats_interval == 0)
+		return;
+
+	clock_type::time_point now = clock_type::now();
+
+	if(now < next_summary)
+		return;
+
+	bool first = next_summary == clock_type::time_point();
+
+	next_summary = now + std::chrono::seconds(settings.stats_interval);
+
+	if(first)
+		return;
+
+	map<string, function_metrics_t> merged;
+	function_metrics_t total;
+	function_stats_t stats;
+
+	merge_tables(merged);
+	memset(&total, 0, sizeof(total));
+
+	for(auto& function : merged)
+		merge_function(function.second, total);
+
+	summarise(total, stats);
+
+	samp_printf("Pawpy: %llu calls, %llu errors, %llu timeouts, %u queued, %u in flight, p50/p95/p99 us: queue %u/%u/%u, GIL %u/%u/%u, exec %u/%u/%u, delivery %u/%u/%u",
+		static_cast<unsigned long long>(stats.calls),
+		static_cast<unsigned long long>(stats.errors),
+		static_cast<unsigned long long>(stats.timeouts),
+		static_cast<unsigned int>(pool_queued),
+		static_cast<unsigned int>(call_count()),
+		stats.latency[METRIC_QUEUE][0], stats.latency[METRIC_QUEUE][1], stats.latency[METRIC_QUEUE][2],
+		stats.latency[METRIC_GIL][0], stats.latency[METRIC_GIL][1], stats.latency[METRIC_GIL][2],
+		stats.latency[METRIC_EXECUTION][0], stats.latency[METRIC_EXECUTION][1], stats.latency[METRIC_EXECUTION][2],
+		stats.latency[METRIC_DELIVERY][0], stats.latency[METRIC_DELIVERY][1], stats.latency[METRIC_DELIVERY][2]);
+}
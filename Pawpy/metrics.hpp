@@ -0,0 +1,84 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Per function call counts and latency histograms. Recording is cheap
+		enough to leave on, see the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_METRICS_H
+#define PAWPY_METRICS_H
+
+#include <string>
+#include <map>
+#include <cstdint>
+
+using std::string;
+using std::map;
+
+#include "main.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+/*
+	Note:
+	The stages of a call that have latency histograms. Queue is the time spent
+	waiting for a worker, GIL the time the worker then waited for the GIL,
+	execution the time spent running the function and delivery the time the
+	result waited for its callback.
+*/
+enum metric_t
+{
+	METRIC_QUEUE,
+	METRIC_GIL,
+	METRIC_EXECUTION,
+	METRIC_DELIVERY,
+	METRIC_COUNT
+};
+
+/*
+	Note:
+	A merged view of one function's metrics, latencies are the 50th, 95th and
+	99th percentiles in microseconds.
+*/
+struct function_stats_t
+{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t timeouts;
+	unsigned int latency[METRIC_COUNT][3];
+};
+
+void metrics_execution(const pycall_t& call);
+void metrics_result(const pycall_t& call);
+void metrics_delivery(const pycall_t& call);
+bool metrics_get(const string& module, const string& function, function_stats_t& stats);
+void metrics_all(map<string, function_stats_t>& stats);
+void metrics_tick();
+
+}
+
+#endif
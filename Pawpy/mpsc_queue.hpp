@@ -0,0 +1,189 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		A lock-free multi-producer/single-consumer FIFO queue. Any number of
+		worker threads can push into it at once without locking and the main
+		thread takes everything that has been pushed so far with a single
+		atomic exchange. Nodes are recycled so a busy queue stops allocating
+		once it has enough of them.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_MPSC_QUEUE_H
+#define PAWPY_MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+
+namespace Pawpy
+{
+
+/*
+	Note:
+	Producers push nodes onto the front of an intrusive singly linked list with
+	a compare-exchange loop, so the list is always in newest-first order. The
+	consumer swaps the whole list out for nullptr in one operation and then
+	reverses it, which gives back the items in the order they were pushed.
+	Since the consumer never touches a node until it has been detached from
+	the shared head there's no ABA problem.
+
+	Drained nodes go onto the spare list instead of being freed. Only the
+	consumer pushes onto it and a producer only ever takes the whole list at
+	once with an exchange, keeping it in a per-thread cache until it's used
+	up, so it has no ABA problem either. A producer only allocates when both
+	its cache and the spare list are empty.
+*/
+template <typename T>
+struct mpsc_queue
+{
+	struct node_t
+	{
+		T value;
+		node_t* next;
+	};
+
+	std::atomic<node_t*> head;
+	std::atomic<node_t*> spare;
+
+	mpsc_queue() : head(nullptr), spare(nullptr) {}
+
+	~mpsc_queue()
+	{
+		free_list(head.exchange(nullptr));
+		free_list(spare.exchange(nullptr));
+	}
+
+	mpsc_queue(const mpsc_queue&) = delete;
+	mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+	/*
+		Note:
+		Safe to call from any number of threads at once.
+	*/
+	void push(T value)
+	{
+		node_t* node = take_node();
+
+		node->value = std::move(value);
+		node->next = head.load(std::memory_order_relaxed);
+
+		while(!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_relaxed) == nullptr;
+	}
+
+	/*
+		Note:
+		Moves everything pushed so far onto the back of "out", oldest first,
+		and returns how many items were taken. Only one thread may drain.
+		out can be any container with push_back.
+	*/
+	template <typename C>
+	size_t drain(C& out)
+	{
+		node_t* list = head.exchange(nullptr, std::memory_order_acquire);
+		node_t* reversed = nullptr;
+		node_t* next;
+		node_t* last = nullptr;
+		size_t count = 0;
+
+		while(list != nullptr)
+		{
+			next = list->next;
+			list->next = reversed;
+			reversed = list;
+			list = next;
+		}
+
+		list = reversed;
+
+		while(reversed != nullptr)
+		{
+			out.push_back(std::move(reversed->value));
+			last = reversed;
+			reversed = reversed->next;
+			++count;
+		}
+
+		if(last != nullptr)
+		{
+			last->next = spare.load(std::memory_order_relaxed);
+
+			while(!spare.compare_exchange_weak(last->next, list, std::memory_order_release, std::memory_order_relaxed))
+				;
+		}
+
+		return count;
+	}
+
+private:
+	/*
+		Note:
+		A producer's cache of spare nodes, freed when the thread exits.
+	*/
+	struct node_cache_t
+	{
+		node_t* list;
+
+		node_cache_t() : list(nullptr) {}
+		~node_cache_t() { free_list(list); }
+	};
+
+	node_t* take_node()
+	{
+		static thread_local node_cache_t cache;
+
+		if(cache.list == nullptr)
+			cache.list = spare.exchange(nullptr, std::memory_order_acquire);
+
+		if(cache.list == nullptr)
+			return new node_t{T(), nullptr};
+
+		node_t* node = cache.list;
+		cache.list = node->next;
+
+		return node;
+	}
+
+	static void free_list(node_t* list)
+	{
+		node_t* next;
+
+		while(list != nullptr)
+		{
+			next = list->next;
+			delete list;
+			list = next;
+		}
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Names are interned the first time they're seen and never removed, a
+		server only ever uses a handful of distinct modules, functions and
+		callbacks. Strings are kept in fixed size chunks that never move, so
+		looking a name up by ID is two array indexes and needs no lock. Only
+		interning a name takes the mutex, which in practice is the main thread
+		reading native parameters and the worker process reader.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+using std::string;
+using std::unordered_map;
+using std::mutex;
+
+#include "main.hpp"
+
+#include "names.hpp"
+
+
+/*
+	Note:
+	Up to NAME_CHUNKS * NAME_CHUNK_SIZE names. The first chunk is static and
+	holds the empty string as ID 0, the rest are allocated as they're needed.
+	A chunk pointer is always written before any ID in it is handed out.
+*/
+static const unsigned int NAME_CHUNK_SIZE = 256;
+static const unsigned int NAME_CHUNKS = 256;
+
+static string first_chunk[NAME_CHUNK_SIZE];
+static string* name_chunks[NAME_CHUNKS] = {first_chunk};
+static unsigned int name_count = 1;
+
+static unordered_map<string, unsigned int> name_index;
+static mutex name_mutex;
+
+
+unsigned int Pawpy::name_id(const string& name)
+{
+	if(name.empty())
+		return 0;
+
+	std::lock_guard<mutex> lock(name_mutex);
+
+	auto found = name_index.find(name);
+
+	if(found != name_index.end())
+		return found->second;
+
+	if(name_count == NAME_CHUNKS * NAME_CHUNK_SIZE)
+	{
+		samp_printf("ERROR: Too many distinct names, '%s' is treated as an empty string.", name.c_str());
+		return 0;
+	}
+
+	unsigned int id = name_count++;
+	string*& chunk = name_chunks[id / NAME_CHUNK_SIZE];
+
+	if(chunk == nullptr)
+		chunk = new string[NAME_CHUNK_SIZE];
+
+	chunk[id % NAME_CHUNK_SIZE] = name;
+	name_index[name] = id;
+
+	return id;
+}
+
+const string& Pawpy::name_string(unsigned int id)
+{
+	return name_chunks[id / NAME_CHUNK_SIZE][id % NAME_CHUNK_SIZE];
+}
+
+/*
+	Note:
+	Reads a string parameter of a native as a name. The characters are read
+	into a buffer that's kept between calls, so a name that's already been
+	interned costs a hash lookup and nothing else. Natives only run on the
+	main thread so one buffer is enough.
+*/
+Pawpy::name_t Pawpy::amx_name(AMX* amx, cell param)
+{
+	static string buffer;
+
+	cell* addr = nullptr;
+	int length = 0;
+
+	amx_GetAddr(amx, param, &addr);
+	amx_StrLen(addr, &length);
+
+	buffer.resize(length + 1);
+	amx_GetString(&buffer[0], addr, 0, length + 1);
+	buffer.resize(length);
+
+	return name_t(buffer);
+}
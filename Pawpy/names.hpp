@@ -0,0 +1,94 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Interned names. Every module, function, callback and format string a
+		script uses is stored once and calls refer to it by a small integer,
+		so making a call doesn't allocate a string for any of them. See the
+		.cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_NAMES_H
+#define PAWPY_NAMES_H
+
+#include <string>
+
+using std::string;
+
+#include "main.hpp"
+#include <amx/amx.h>
+
+
+namespace Pawpy
+{
+
+unsigned int name_id(const string& name);
+const string& name_string(unsigned int id);
+
+/*
+	Note:
+	A name is just its ID, copying one is copying an int. It converts to and
+	from a string so it can be used almost anywhere a string was used before,
+	converting from a string interns it. ID 0 is always the empty string.
+*/
+class name_t
+{
+public:
+	name_t() : id(0) {}
+	name_t(const string& name) : id(name_id(name)) {}
+	name_t(const char* name) : id(name_id(name)) {}
+
+	unsigned int key() const { return id; }
+	const string& str() const { return name_string(id); }
+	const char* c_str() const { return str().c_str(); }
+	size_t length() const { return str().length(); }
+	size_t size() const { return str().size(); }
+	bool empty() const { return id == 0; }
+	char operator[](size_t i) const { return str()[i]; }
+	string::const_iterator begin() const { return str().begin(); }
+	string::const_iterator end() const { return str().end(); }
+
+	operator const string&() const { return str(); }
+
+	bool operator==(const name_t& other) const { return id == other.id; }
+	bool operator!=(const name_t& other) const { return id != other.id; }
+
+private:
+	unsigned int id;
+};
+
+/*
+	Note:
+	One key for a module and function pair, for tables of per-function
+	settings that used to be keyed by "module.function".
+*/
+inline unsigned long long name_pair(name_t module, name_t function)
+{
+	return (static_cast<unsigned long long>(module.key()) << 32) | function.key();
+}
+
+name_t amx_name(AMX* amx, cell param);
+
+}
+
+#endif
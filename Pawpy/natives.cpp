@@ -45,137 +45,941 @@
 
 #include <string>
 #include <vector>
+#include <map>
 
 using std::string;
 using std::vector;
+using std::map;
 
 #include "natives.hpp"
 #include "pawpy.hpp"
+#include "pool.hpp"
+#include "process.hpp"
+#include "eventloop.hpp"
+#include "cache.hpp"
+#include "callstate.hpp"
+#include "watchdog.hpp"
+#include "metrics.hpp"
+#include "callables.hpp"
+#include "records.hpp"
+#include "trace.hpp"
+#include "log.hpp"
+#include "errors.hpp"
 
 
+/*
+	Note:
+	Runs a Python function on the main thread and writes the string it returns
+	into the output array. This blocks the server for the duration of the
+	call so it's meant for small pure functions (lookup tables, formatting
+	helpers) where a worker and a callback a tick later would cost more than
+	the call itself. Returns 0 on success and 1 if the call failed.
+*/
 cell Native::RunPython(AMX* amx, cell* params)
 {
 	debug("Native::RunPython called");
 
-	string
-		module,
-		function,
-		callback;
+	Pawpy::pycall_t call = Pawpy::prepare(Pawpy::amx_name(amx, params[1]), Pawpy::amx_name(amx, params[2]), Pawpy::name_t(), Pawpy::name_t());
+
+	extract_params(amx, params, 5, call.arguments);
+
+	cell result = 0;
 
-	vector<string> arguments = extract_params(amx, params, 3);
+	if(!Pawpy::cache_lookup(call))
+	{
+		if(Pawpy::run_python_main(call))
+		{
+			Pawpy::cache_store(call);
+		}
+		else
+		{
+			call.failed = true;
+			Pawpy::errors_result(call);
+			result = 1;
+		}
+	}
 
-	module = amx_GetCppString(amx, params[1]);
-	function = amx_GetCppString(amx, params[2]);
-	callback = "";
+	if(result == 0)
+	{
+		cell* output_ptr = nullptr;
 
-	string result = Pawpy::run_python(Pawpy::prepare(module, function, callback, arguments));
+		amx_GetAddr(amx, params[3], &output_ptr);
+		amx_SetString(output_ptr, call.returns.c_str(), 0, 0, params[4]);
+	}
 
-	// todo: return result back to samp somehow
+	if(Pawpy::tracing())
+		Pawpy::trace_span("RunPython", call.module, call.function, 0, call.timing.entered, std::chrono::steady_clock::now());
 
-	return 1;
+	Pawpy::record_release(std::move(call));
+
+	return result;
 }
 
+/*
+	Note:
+	Returns the call's ID, which is also passed to the callback as its last
+	parameter, or 0 if the call couldn't be made.
+*/
 cell Native::RunPythonThreaded(AMX* amx, cell* params)
+{
+	return run_threaded(amx, params, 0, Pawpy::PRIORITY_NORMAL);
+}
+
+/*
+	Note:
+	RunPythonThreaded with a priority in front. Workers always take the most
+	urgent call that's waiting, so a high priority call (an anti-cheat check)
+	doesn't wait behind a pile of low priority ones (analytics).
+*/
+cell Native::RunPythonThreadedEx(AMX* amx, cell* params)
+{
+	if(!valid_priority(params[1]))
+		return 0;
+
+	return run_threaded(amx, params, 1, params[1]);
+}
+
+/*
+	Note:
+	The body of RunPythonThreaded and RunPythonThreadedEx, offset is the
+	number of parameters before the module name.
+*/
+cell Native::run_threaded(AMX* amx, cell* params, uint8_t offset, int priority)
 {
 	debug("RunPythonThreaded: called");
 
-	string
-		module,
-		function,
-		callback;
+	Pawpy::name_t return_format = Pawpy::amx_name(amx, params[offset + 4]);
 
-	vector<string> arguments = extract_params(amx, params, 4);
+	if(!valid_return_format(return_format, offset == 0 ? "RunPythonThreaded" : "RunPythonThreadedEx"))
+		return 0;
 
-	module = amx_GetCppString(amx, params[1]);
-	function = amx_GetCppString(amx, params[2]);
-	callback = amx_GetCppString(amx, params[3]);
+	Pawpy::pycall_t call = Pawpy::prepare(
+		Pawpy::amx_name(amx, params[offset + 1]),
+		Pawpy::amx_name(amx, params[offset + 2]),
+		Pawpy::amx_name(amx, params[offset + 3]),
+		return_format);
+
+	extract_params(amx, params, offset + 5, call.arguments);
 	debug("RunPythonThreaded: optained parameters");
 
-	Pawpy::run_python_threaded(Pawpy::prepare(module, function, callback, arguments));
+	call.amx = amx;
+	call.priority = priority;
+
+	cell id = Pawpy::run_python_threaded(std::move(call));
 	debug("RunPythonThreaded: finished");
 
+	return id;
+}
+
+/*
+	Note:
+	Stops a call's callback from being called, and if no worker has picked the
+	call up yet it's removed from the queue so it never runs. Returns 1 if the
+	call was found, 0 if it doesn't exist or its callback was already called.
+*/
+cell Native::CancelPythonCall(AMX* amx, cell* params)
+{
+	if(!Pawpy::call_cancel(params[1]))
+		return 0;
+
+	if(Pawpy::pool_cancel(params[1]))
+		Pawpy::call_forget(params[1]);
+
+	return 1;
+}
+
+cell Native::GetPythonCallStatus(AMX* amx, cell* params)
+{
+	return Pawpy::call_status(params[1]);
+}
+
+/*
+	Note:
+	Sets the timeout, in milliseconds, for every threaded call to a module.
+	A call that runs for longer has a TimeoutError raised inside it, see
+	watchdog.cpp. Zero removes the timeout.
+*/
+cell Native::SetPythonTimeout(AMX* amx, cell* params)
+{
+	if(params[2] < 0)
+	{
+		samp_printf("ERROR: Invalid timeout %d passed to SetPythonTimeout.", params[2]);
+		return 1;
+	}
+
+	Pawpy::set_module_timeout(amx_GetCppString(amx, params[1]), params[2]);
+
 	return 0;
-}
-
-vector<string> Native::extract_params(AMX* amx, cell* params, uint8_t base_arg_count)
-{
-	string argformat = amx_GetCppString(amx, params[base_arg_count]);
+}
+
+/*
+	Note:
+	Overrides the module's timeout for one call. Returns 1 if the call was
+	found, 0 if it doesn't exist or has already finished.
+*/
+cell Native::SetPythonCallTimeout(AMX* amx, cell* params)
+{
+	if(params[2] < 0)
+	{
+		samp_printf("ERROR: Invalid timeout %d passed to SetPythonCallTimeout.", params[2]);
+		return 0;
+	}
+
+	return Pawpy::call_set_timeout(params[1], params[2]);
+}
+
+cell Native::GetPythonTimeouts(AMX* amx, cell* params)
+{
+	Pawpy::function_stats_t stats;
+
+	if(!Pawpy::metrics_get(amx_GetCppString(amx, params[1]), amx_GetCppString(amx, params[2]), stats))
+		return 0;
+
+	return static_cast<cell>(stats.timeouts);
+}
+
+/*
+	Note:
+	How many calls to a function have failed, not counting timeouts. This is
+	cheap enough to check before every call so a script can stop calling a
+	function that keeps failing, or call it less often.
+*/
+cell Native::GetPythonErrors(AMX* amx, cell* params)
+{
+	return Pawpy::errors_count(Pawpy::amx_name(amx, params[1]), Pawpy::amx_name(amx, params[2]));
+}
+
+/*
+	Note:
+	Writes one function's counters and latency percentiles into an array
+	indexed by PyFunctionStat, latencies are in microseconds. Returns 0 if the
+	function hasn't finished any calls yet.
+*/
+cell Native::GetPythonStats(AMX* amx, cell* params)
+{
+	Pawpy::function_stats_t stats;
+
+	if(!Pawpy::metrics_get(amx_GetCppString(amx, params[1]), amx_GetCppString(amx, params[2]), stats))
+		return 0;
+
+	cell values[PY_FSTAT_COUNT];
+
+	values[PY_FSTAT_CALLS] = static_cast<cell>(stats.calls);
+	values[PY_FSTAT_ERRORS] = static_cast<cell>(stats.errors);
+	values[PY_FSTAT_TIMEOUTS] = static_cast<cell>(stats.timeouts);
+
+	for(int i = 0; i < Pawpy::METRIC_COUNT; ++i)
+	{
+		for(int j = 0; j < 3; ++j)
+			values[PY_FSTAT_QUEUE_P50 + i * 3 + j] = stats.latency[i][j];
+	}
+
+	cell* output;
+	amx_GetAddr(amx, params[3], &output);
+
+	for(cell i = 0; i < params[4] && i < PY_FSTAT_COUNT; ++i)
+		output[i] = values[i];
+
+	return 1;
+}
+
+bool Native::valid_priority(cell priority)
+{
+	if(priority < 0 || priority >= Pawpy::PRIORITY_COUNT)
+	{
+		samp_printf("ERROR: Invalid priority %d.", priority);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+	Note:
+	Calls the same function once for each of count items in one worker job.
+	Every argument is an array of count cells and item i gets element i of
+	each array, so only 'd' and 'f' arguments make sense here. Use the
+	PyBatch functions for anything else.
+*/
+cell Native::RunPythonBatch(AMX* amx, cell* params)
+{
+	debug("RunPythonBatch: called");
+
+	Pawpy::name_t return_format = Pawpy::amx_name(amx, params[4]);
+
+	if(!valid_batch(return_format, params[5], "RunPythonBatch"))
+		return 0;
+
+	if(params[6] <= 0)
+	{
+		samp_printf("ERROR: Invalid item count %d passed to RunPythonBatch.", params[6]);
+		return 0;
+	}
+
+	Pawpy::pycall_t call = Pawpy::prepare(
+		Pawpy::amx_name(amx, params[1]),
+		Pawpy::amx_name(amx, params[2]),
+		Pawpy::amx_name(amx, params[3]),
+		return_format);
+
+	call.arguments.clear();
+	call.batch = extract_columns(amx, params, 7, params[6]);
+	call.batch_single = params[5] == PY_BATCH_SINGLE;
+	call.amx = amx;
+
+	if(call.batch.empty())
+	{
+		Pawpy::record_release(std::move(call));
+		return 0;
+	}
+
+	return Pawpy::run_python_threaded(std::move(call));
+}
+
+/*
+	Note:
+	Batches that are being built, keyed by the ID PyBatchBegin returned. Only
+	ever touched by natives so it's main thread only.
+*/
+static map<cell, Pawpy::pycall_t> building_batches;
+static cell next_batch_id = 0;
+
+/*
+	Note:
+	Starts building a batch of calls to one function, arguments for each item
+	are added with PyBatchAdd and the whole thing is sent off to a worker with
+	PyBatchSubmit. Returns the batch ID or -1 on error.
+*/
+cell Native::PyBatchBegin(AMX* amx, cell* params)
+{
+	Pawpy::name_t return_format = Pawpy::amx_name(amx, params[4]);
+
+	if(!valid_batch(return_format, params[5], "PyBatchBegin") || !valid_priority(params[6]))
+		return -1;
+
+	Pawpy::pycall_t call = Pawpy::prepare(
+		Pawpy::amx_name(amx, params[1]),
+		Pawpy::amx_name(amx, params[2]),
+		Pawpy::amx_name(amx, params[3]),
+		return_format);
+
+	call.arguments.clear();
+	call.batch_single = params[5] == PY_BATCH_SINGLE;
+	call.amx = amx;
+	call.priority = params[6];
+
+	cell id = next_batch_id++;
+
+	building_batches[id] = std::move(call);
+
+	return id;
+}
+
+/*
+	Note:
+	Adds one item to a batch, the arguments are the same as the variadic part
+	of RunPythonThreaded.
+*/
+cell Native::PyBatchAdd(AMX* amx, cell* params)
+{
+	auto batch = building_batches.find(params[1]);
+
+	if(batch == building_batches.end())
+	{
+		samp_printf("ERROR: Invalid batch ID %d passed to PyBatchAdd.", params[1]);
+		return 1;
+	}
+
+	batch->second.batch.emplace_back();
+	extract_params(amx, params, 2, batch->second.batch.back());
+
+	return 0;
+}
+
+cell Native::PyBatchSubmit(AMX* amx, cell* params)
+{
+	auto batch = building_batches.find(params[1]);
+
+	if(batch == building_batches.end())
+	{
+		samp_printf("ERROR: Invalid batch ID %d passed to PyBatchSubmit.", params[1]);
+		return 0;
+	}
+
+	Pawpy::pycall_t call = std::move(batch->second);
+	building_batches.erase(batch);
+
+	if(call.batch.empty())
+	{
+		samp_printf("ERROR: Batch %d submitted without any items.", params[1]);
+		Pawpy::record_release(std::move(call));
+		return 0;
+	}
+
+	return Pawpy::run_python_threaded(std::move(call));
+}
+
+/*
+	Note:
+	A call site made by PreparePythonCall. call is a template with everything
+	but the arguments filled in, each RunPreparedCall takes a spare record and
+	fills it in from this.
+*/
+struct prepared_call_t
+{
+	Pawpy::pycall_t call;
+	Pawpy::name_t argformat;
+};
+
+/*
+	Note:
+	Prepared calls, keyed by handle. Handles are never reused so a stale one
+	can't end up calling something else. They're removed by FreePreparedCall
+	or when the script that made them unloads.
+*/
+static map<cell, prepared_call_t> prepared_calls;
+static cell next_prepared_id = 0;
+
+/*
+	Note:
+	Reads and checks the strings of a call once and returns a handle that
+	RunPreparedCall can use any number of times, so a call made in a hot loop
+	only pays for its arguments. The callback is looked up now as well so a
+	typo is reported straight away. Returns -1 on error.
+*/
+cell Native::PreparePythonCall(AMX* amx, cell* params)
+{
+	Pawpy::name_t callback = Pawpy::amx_name(amx, params[3]);
+	Pawpy::name_t return_format = Pawpy::amx_name(amx, params[4]);
+	Pawpy::name_t argformat = Pawpy::amx_name(amx, params[5]);
+
+	if(!valid_return_format(return_format, "PreparePythonCall") || !valid_priority(params[6]))
+		return -1;
+
+	for(size_t i = 0; i < argformat.length(); ++i)
+	{
+		switch(argformat[i])
+		{
+		case 'd':
+		case 'i':
+		case 'f':
+		case 's':
+			break;
+
+		case 'a':
+		case 'm':
+		case 'M':
+			if(i + 1 < argformat.length() && (argformat[i + 1] == 'd' || argformat[i + 1] == 'i'))
+				break;
+
+			samp_printf("ERROR: Array argument %d in PreparePythonCall must be followed by a 'd' size argument.", i);
+			return -1;
+
+		default:
+			samp_printf("ERROR: Invalid format specifier: '%c' in PreparePythonCall", argformat[i]);
+			return -1;
+		}
+	}
+
+	int index;
+
+	if(amx_FindPublic(amx, callback.c_str(), &index) != AMX_ERR_NONE)
+	{
+		samp_printf("ERROR: Callback '%s' passed to PreparePythonCall doesn't exist.", callback.c_str());
+		return -1;
+	}
+
+	/*
+		Note:
+		Only take a record once everything has been checked, an early return
+		would otherwise lose it.
+	*/
+	prepared_call_t prepared;
+
+	prepared.call = Pawpy::prepare(
+		Pawpy::amx_name(amx, params[1]),
+		Pawpy::amx_name(amx, params[2]),
+		callback,
+		return_format);
+
+	prepared.call.arguments.clear();
+	prepared.call.amx = amx;
+	prepared.call.priority = params[6];
+	prepared.argformat = argformat;
+
+	cell handle = next_prepared_id++;
+
+	prepared_calls[handle] = std::move(prepared);
+
+	return handle;
+}
+
+/*
+	Note:
+	Makes a prepared call, the variadic arguments must match the format given
+	to PreparePythonCall. Returns the call ID or 0 on failure, the same as
+	RunPythonThreaded.
+*/
+cell Native::RunPreparedCall(AMX* amx, cell* params)
+{
+	auto found = prepared_calls.find(params[1]);
+
+	if(found == prepared_calls.end() || found->second.call.amx != amx)
+	{
+		samp_printf("ERROR: Invalid handle %d passed to RunPreparedCall.", params[1]);
+		return 0;
+	}
+
+	prepared_call_t& prepared = found->second;
+	Pawpy::pycall_t call = Pawpy::prepare(prepared.call.module, prepared.call.function, prepared.call.callback, prepared.call.return_format);
+
+	call.amx = prepared.call.amx;
+	call.priority = prepared.call.priority;
+
+	extract_arguments(amx, params, 1, prepared.argformat, call.arguments);
+
+	return Pawpy::run_python_threaded(std::move(call));
+}
+
+/*
+	Note:
+	Frees a handle from PreparePythonCall once the script doesn't need it any
+	more. Returns 0 on success or 1 if the handle isn't valid.
+*/
+cell Native::FreePreparedCall(AMX* amx, cell* params)
+{
+	auto found = prepared_calls.find(params[1]);
+
+	if(found == prepared_calls.end() || found->second.call.amx != amx)
+	{
+		samp_printf("ERROR: Invalid handle %d passed to FreePreparedCall.", params[1]);
+		return 1;
+	}
+
+	Pawpy::record_release(std::move(found->second.call));
+	prepared_calls.erase(found);
+
+	return 0;
+}
+
+/*
+	Note:
+	Called from AmxUnload. Prepared calls and unsubmitted batches belong to
+	the script that made them, a new script loaded at the same address must
+	not be able to use them.
+*/
+void Native::amx_unload(AMX* amx)
+{
+	for(auto it = prepared_calls.begin(); it != prepared_calls.end();)
+	{
+		if(it->second.call.amx != amx)
+		{
+			++it;
+			continue;
+		}
+
+		Pawpy::record_release(std::move(it->second.call));
+		it = prepared_calls.erase(it);
+	}
+
+	for(auto it = building_batches.begin(); it != building_batches.end();)
+	{
+		if(it->second.amx != amx)
+		{
+			++it;
+			continue;
+		}
+
+		Pawpy::record_release(std::move(it->second));
+		it = building_batches.erase(it);
+	}
+}
+
+/*
+	Note:
+	Starts recording every call's progress into a Chrome trace file, see
+	trace.cpp. The file is relative to the server's directory and is only
+	complete once StopPythonTrace is called (or the server shuts down).
+	Returns 0 on success and 1 if a trace is already running or the file
+	couldn't be opened.
+*/
+cell Native::StartPythonTrace(AMX* amx, cell* params)
+{
+	if(!Pawpy::trace_start(amx_GetCppString(amx, params[1])))
+		return 1;
+
+	return 0;
+}
+
+/*
+	Note:
+	Finishes the trace file. Returns 1 if there was no trace running.
+*/
+cell Native::StopPythonTrace(AMX* amx, cell* params)
+{
+	if(!Pawpy::trace_stop())
+		return 1;
+
+	return 0;
+}
+
+/*
+	Note:
+	A single callback for a whole batch gets one value per item in an array,
+	so each item must return exactly one int or float.
+*/
+bool Native::valid_batch(const string& return_format, cell mode, const char* native)
+{
+	if(!valid_return_format(return_format, native))
+		return false;
+
+	switch(mode)
+	{
+	case PY_BATCH_EACH:
+		return true;
+
+	case PY_BATCH_SINGLE:
+		if(return_format != "d" && return_format != "f")
+		{
+			samp_printf("ERROR: PY_BATCH_SINGLE needs a return format of \"d\" or \"f\", got '%s'.", return_format.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	samp_printf("ERROR: Invalid batch mode %d passed to %s.", mode, native);
+	return false;
+}
+
+/*
+	Note:
+	Checks a return format string on the main thread so a typo is reported
+	when the call is made rather than when the result comes back. native is
+	the name of the native that was called, for the error.
+*/
+bool Native::valid_return_format(const string& return_format, const char* native)
+{
+	for(char c : return_format)
+	{
+		switch(c)
+		{
+		case 'd':
+		case 'f':
+		case 's':
+		case 'a':
+		case 'v':
+		case 'm':
+		case 'M':
+			break;
+
+		default:
+			samp_printf("ERROR: Invalid return format specifier: '%c' in %s", c, native);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+	Note:
+	Modules and functions are cached after their first use, so changes to a
+	script file aren't picked up until the module is explicitly reloaded. An
+	empty module name reloads every module that has been used so far. The
+	reload happens on a worker the next time any function is resolved. Worker
+	processes have their own caches so they're sent the reload too.
+*/
+cell Native::ReloadPythonModule(AMX* amx, cell* params)
+{
+	string module = amx_GetCppString(amx, params[1]);
+
+	Pawpy::request_reload(module);
+	Pawpy::cache_clear(module);
+
+	if(Pawpy::process_enabled())
+		Pawpy::process_reload(module);
+
+	return 0;
+}
+
+/*
+	Note:
+	Opts a function in to the result cache. Only use this for functions that
+	return the same thing every time they're given the same arguments, a
+	cached result is delivered without calling the function at all. The TTL
+	is in milliseconds, zero turns caching off again.
+*/
+cell Native::SetPythonCacheTTL(AMX* amx, cell* params)
+{
+	if(params[3] < 0)
+	{
+		samp_printf("ERROR: Invalid cache TTL %d passed to SetPythonCacheTTL.", params[3]);
+		return 1;
+	}
+
+	Pawpy::cache_set_ttl(amx_GetCppString(amx, params[1]), amx_GetCppString(amx, params[2]), params[3]);
+
+	return 0;
+}
+
+/*
+	Note:
+	Lets identical calls to a function share one execution while it's running,
+	see cache.cpp. Functions with a cache TTL do this regardless.
+*/
+cell Native::SetPythonCoalesce(AMX* amx, cell* params)
+{
+	Pawpy::flight_set(amx_GetCppString(amx, params[1]), amx_GetCppString(amx, params[2]), params[3] != 0);
+
+	return 0;
+}
+
+/*
+	Note:
+	Makes a callback get all of a tick's results in one call instead of one
+	call each, see amx_tick.
+*/
+cell Native::SetPythonCallbackBatched(AMX* amx, cell* params)
+{
+	Pawpy::amx_set_batched(amx, amx_GetCppString(amx, params[1]), params[2] != 0);
+
+	return 0;
+}
+
+/*
+	Note:
+	Returns one of the plugin's internal counters, mostly so the worker pool
+	can be sized based on what a real server actually does.
+*/
+cell Native::GetPythonStat(AMX* amx, cell* params)
+{
+	switch(params[1])
+	{
+	case PY_STAT_WORKERS:
+		return Pawpy::pool_workers;
+
+	case PY_STAT_QUEUE_CAPACITY:
+		return Pawpy::pool_queue_depth;
+
+	case PY_STAT_QUEUE_DEPTH:
+		return Pawpy::pool_queued;
+
+	case PY_STAT_QUEUE_PEAK:
+		return Pawpy::pool_queued_peak;
+
+	case PY_STAT_QUEUE_REJECTED:
+		return Pawpy::pool_rejected;
+
+	case PY_STAT_BACKLOG:
+		return Pawpy::backlog_size();
+
+	case PY_STAT_DEFERRED:
+		return Pawpy::backlog_deferred;
+
+	case PY_STAT_DEFERRED_TICKS:
+		return Pawpy::backlog_deferred_ticks;
+
+	case PY_STAT_ISOLATED_WORKERS:
+		return Pawpy::pool_isolated;
+
+	case PY_STAT_PROCESSES:
+		return Pawpy::process_count();
+
+	case PY_STAT_PROCESS_RESTARTS:
+		return Pawpy::process_restarts();
+
+	case PY_STAT_ASYNC_INFLIGHT:
+		return Pawpy::loop_inflight;
+
+	case PY_STAT_ASYNC_PEAK:
+		return Pawpy::loop_inflight_peak;
+
+	case PY_STAT_ASYNC_OVERFLOW:
+		return Pawpy::loop_overflow;
+
+	case PY_STAT_CACHE_HITS:
+		return Pawpy::cache_hits;
+
+	case PY_STAT_CACHE_MISSES:
+		return Pawpy::cache_misses;
+
+	case PY_STAT_CACHE_ENTRIES:
+		return Pawpy::cache_entries();
+
+	case PY_STAT_CACHE_MEMORY:
+		return Pawpy::cache_memory();
+
+	case PY_STAT_COALESCED:
+		return Pawpy::flight_coalesced;
+
+	case PY_STAT_TIMEOUTS:
+		return Pawpy::timeouts_total;
+
+	case PY_STAT_INFLIGHT:
+		return Pawpy::call_count();
+
+	case PY_STAT_CALLBACK_EXECS:
+		return Pawpy::callback_execs;
+
+	case PY_STAT_CALLBACK_BATCHED:
+		return Pawpy::callback_batched;
+
+	case PY_STAT_CALLBACK_HEAP_PEAK:
+		return Pawpy::callback_heap_peak;
+
+	case PY_STAT_TICK_TIME:
+		return Pawpy::tick_time;
+
+	case PY_STAT_TICK_TIME_PEAK:
+		return Pawpy::tick_time_peak;
+
+	case PY_STAT_LOG_DROPPED:
+		return Pawpy::log_dropped;
+	}
+
+	samp_printf("ERROR: Invalid stat ID %d passed to GetPythonStat.", params[1]);
+	return -1;
+}
+
+/*
+	Note:
+	Reads the variadic arguments described by the format string. Nothing is
+	converted here, the cells are copied straight out of AMX memory so the
+	main thread only pays for the copy. An 'a' (array) argument must be
+	followed by a 'd' argument holding the array size, both are passed on.
+	'm' and 'M' arrays work the same way but reach Python as a memoryview.
+*/
+void Native::extract_params(AMX* amx, cell* params, uint8_t base_arg_count, vector<Pawpy::pyarg_t>& arguments)
+{
+	extract_arguments(amx, params, base_arg_count, Pawpy::amx_name(amx, params[base_arg_count]), arguments);
+}
+
+/*
+	Note:
+	Does the work for extract_params with a format string that has already
+	been read, which is how prepared calls skip reading it from the AMX every
+	time. The variadic arguments start after parameter base_arg_count.
+
+	arguments is usually a recycled record's argument list (see records.cpp),
+	its entries are overwritten in place so the cells they already have are
+	reused instead of every argument allocating its own again.
+*/
+void Native::extract_arguments(AMX* amx, cell* params, uint8_t base_arg_count, const string& argformat, vector<Pawpy::pyarg_t>& arguments)
+{
 	size_t numargs = static_cast<cell>(params[0] / sizeof(cell));
 
-	vector<string> arguments;
-	arguments.reserve(numargs - base_arg_count);
+	size_t count = 0;
 	uint8_t arg_count = 0;
 	cell *addr_ptr = nullptr;
-	cell arg_value;
-	float arg_value_float;
 	cell *addr_ptr_arr = nullptr;
-	string array_string;
+	char arr_type = 'a';
+	int length;
 
 	if(argformat.length() != numargs - base_arg_count)
 	{
 		samp_printf("ERROR: Argument length (%d) does not match format specifier count (%d).", numargs - base_arg_count, argformat.length());
-		return arguments;
+		arguments.clear();
+		return;
 	}
 
+	/*
+		Note:
+		Every specifier produces at most one argument (an array's comes with
+		its size) so this is enough room, it's trimmed to count at the end.
+	*/
+	arguments.resize(argformat.length());
+
 	for(char c : argformat)
 	{
 		switch(c)
 		{
 		case 'd':
 		case 'i':
+		{
 			amx_GetAddr(amx, params[arg_count + base_arg_count + 1], &addr_ptr);
 			arg_count++;
-			arg_value = *addr_ptr;
 
 			if(addr_ptr_arr != nullptr)
 			{
-				if(arg_value <= 0)
+				if(*addr_ptr <= 0)
 				{
 					samp_printf("ERROR: Invalid array size found in int parameter following array parameter.");
-					return arguments;
+					arguments.resize(count);
+					return;
 				}
 
-				array_string = "[" + std::to_string(addr_ptr_arr[0]);
-				for(int i = 1; i < arg_value; i++)
-				{
-					array_string += ", " + std::to_string(addr_ptr_arr[i]);
-				}
-				array_string += "]";
-
-				arguments.push_back(array_string);
+				Pawpy::pyarg_t& arr = arguments[count++];
+				arr.type = arr_type;
+				arr.value = *addr_ptr;
+				arr.cells.assign(addr_ptr_arr, addr_ptr_arr + arr.value);
 
 				addr_ptr_arr = nullptr;
-				debug("[arg %d] found parameter of type int: %d as size for array %s", arg_count, arg_value, array_string.c_str());
+				debug("[arg %d] found parameter of type int: %d as size for array", arg_count, arr.value);
 			}
 			else
 			{
-				debug("[arg %d] found parameter of type int: %d", arg_count, arg_value);
+				debug("[arg %d] found parameter of type int: %d", arg_count, *addr_ptr);
 			}
 
-			arguments.push_back(std::to_string(arg_value));
+			Pawpy::pyarg_t& arg = arguments[count++];
+			arg.type = 'd';
+			arg.value = *addr_ptr;
+			arg.cells.clear();
 			break;
+		}
 
 		case 'f':
+		{
 			amx_GetAddr(amx, params[arg_count + base_arg_count + 1], &addr_ptr);
-			arg_value_float = *((float*)addr_ptr);
-			arguments.push_back(std::to_string(arg_value_float));
 			arg_count++;
 
-			debug("[arg %d] found parameter of type float: %f", arg_count, arg_value_float);
+			Pawpy::pyarg_t& arg = arguments[count++];
+			arg.type = 'f';
+			arg.value = *addr_ptr;
+			arg.cells.clear();
+
+			debug("[arg %d] found parameter of type float: %f", arg_count, amx_ctof(arg.value));
 			break;
+		}
 
 		case 's':
-			arguments.push_back(amx_GetCppString(amx, params[arg_count + base_arg_count + 1]));
+		{
+			amx_GetAddr(amx, params[arg_count + base_arg_count + 1], &addr_ptr);
+			amx_StrLen(addr_ptr, &length);
 			arg_count++;
 
-			debug("[arg %d] found parameter of type string: %s", arg_count, arguments[arg_count - 1].c_str());
+			Pawpy::pyarg_t& arg = arguments[count++];
+			arg.type = 's';
+			arg.value = length;
+
+			/*
+				Note:
+				Unpacked strings (the usual kind) are copied cell for cell,
+				packed strings have to be unpacked by the SDK first.
+			*/
+			if(static_cast<ucell>(*addr_ptr) > UNPACKEDMAX)
+			{
+				string packed = amx_GetCppString(amx, params[arg_count + base_arg_count]);
+				arg.cells.assign(packed.begin(), packed.end());
+			}
+			else
+			{
+				arg.cells.assign(addr_ptr, addr_ptr + length);
+			}
+
+			debug("[arg %d] found parameter of type string, length %d", arg_count, length);
 			break;
+		}
 
 		case 'a':
+		case 'm':
+		case 'M':
 			amx_GetAddr(amx, params[arg_count + base_arg_count + 1], &addr_ptr_arr);
+			arr_type = c;
 			arg_count++;
 
-			debug("[arg %d] found parameter of type array (detailed in next d argument)", arg_count);
+			debug("[arg %d] found parameter of type array '%c' (detailed in next d argument)", arg_count, c);
 			break;
 
 		default:
@@ -183,5 +987,61 @@ vector<string> Native::extract_params(AMX* amx, cell* params, uint8_t base_arg_c
 		}
 	}
 
-	return arguments;
+	arguments.resize(count);
+}
+
+/*
+	Note:
+	Reads the arguments of RunPythonBatch, one array of count cells per format
+	specifier, and turns them into one argument list per item.
+*/
+vector<vector<Pawpy::pyarg_t>> Native::extract_columns(AMX* amx, cell* params, uint8_t base_arg_count, cell count)
+{
+	string argformat = amx_GetCppString(amx, params[base_arg_count]);
+	size_t numargs = static_cast<cell>(params[0] / sizeof(cell));
+
+	vector<vector<Pawpy::pyarg_t>> items;
+	cell *addr_ptr = nullptr;
+	Pawpy::pyarg_t arg;
+
+	if(argformat.length() != numargs - base_arg_count)
+	{
+		samp_printf("ERROR: Argument length (%d) does not match format specifier count (%d).", numargs - base_arg_count, argformat.length());
+		return items;
+	}
+
+	items.resize(count);
+
+	for(auto& item : items)
+		item.reserve(argformat.length());
+
+	for(size_t i = 0; i < argformat.length(); ++i)
+	{
+		switch(argformat[i])
+		{
+		case 'd':
+		case 'i':
+			arg.type = 'd';
+			break;
+
+		case 'f':
+			arg.type = 'f';
+			break;
+
+		default:
+			samp_printf("ERROR: Invalid format specifier: '%c' in RunPythonBatch, only 'd' and 'f' arrays are supported", argformat[i]);
+			items.clear();
+			return items;
+		}
+
+		amx_GetAddr(amx, params[base_arg_count + 1 + i], &addr_ptr);
+
+		for(cell j = 0; j < count; ++j)
+		{
+			arg.value = addr_ptr[j];
+			items[j].push_back(arg);
+		}
+	}
+
+	return items;
 }
@@ -42,17 +42,120 @@ using std::string;
 using std::vector;
 
 #include "main.hpp"
+#include "pawpy.hpp"
 #include <amx/amx.h>
 #include <amx/amx2.h>
 #include <plugincommon.h>
 
 
+/*
+	Note:
+	Values for GetPythonStat, these must match the PyStat enumerator in
+	pawpy.inc.
+*/
+enum py_stat_t
+{
+	PY_STAT_WORKERS,
+	PY_STAT_QUEUE_CAPACITY,
+	PY_STAT_QUEUE_DEPTH,
+	PY_STAT_QUEUE_PEAK,
+	PY_STAT_QUEUE_REJECTED,
+	PY_STAT_BACKLOG,
+	PY_STAT_DEFERRED,
+	PY_STAT_DEFERRED_TICKS,
+	PY_STAT_ISOLATED_WORKERS,
+	PY_STAT_PROCESSES,
+	PY_STAT_PROCESS_RESTARTS,
+	PY_STAT_ASYNC_INFLIGHT,
+	PY_STAT_ASYNC_PEAK,
+	PY_STAT_ASYNC_OVERFLOW,
+	PY_STAT_CACHE_HITS,
+	PY_STAT_CACHE_MISSES,
+	PY_STAT_CACHE_ENTRIES,
+	PY_STAT_CACHE_MEMORY,
+	PY_STAT_COALESCED,
+	PY_STAT_TIMEOUTS,
+	PY_STAT_INFLIGHT,
+	PY_STAT_CALLBACK_EXECS,
+	PY_STAT_CALLBACK_BATCHED,
+	PY_STAT_CALLBACK_HEAP_PEAK,
+	PY_STAT_TICK_TIME,
+	PY_STAT_TICK_TIME_PEAK,
+	PY_STAT_LOG_DROPPED
+};
+
+/*
+	Note:
+	Indices into the array GetPythonStats fills, these must match the
+	PyFunctionStat enumerator in pawpy.inc. The latency percentiles follow
+	Pawpy::metric_t in order, three each.
+*/
+enum py_function_stat_t
+{
+	PY_FSTAT_CALLS,
+	PY_FSTAT_ERRORS,
+	PY_FSTAT_TIMEOUTS,
+	PY_FSTAT_QUEUE_P50,
+	PY_FSTAT_QUEUE_P95,
+	PY_FSTAT_QUEUE_P99,
+	PY_FSTAT_GIL_P50,
+	PY_FSTAT_GIL_P95,
+	PY_FSTAT_GIL_P99,
+	PY_FSTAT_EXECUTION_P50,
+	PY_FSTAT_EXECUTION_P95,
+	PY_FSTAT_EXECUTION_P99,
+	PY_FSTAT_DELIVERY_P50,
+	PY_FSTAT_DELIVERY_P95,
+	PY_FSTAT_DELIVERY_P99,
+	PY_FSTAT_COUNT
+};
+
+/*
+	Note:
+	How batch results are delivered, these must match the PyBatchMode
+	enumerator in pawpy.inc.
+*/
+enum py_batch_mode_t
+{
+	PY_BATCH_EACH,
+	PY_BATCH_SINGLE
+};
+
 namespace Native 
 {
 	cell RunPython(AMX *amx, cell *params);
 	cell RunPythonThreaded(AMX *amx, cell *params);
-
-	vector<string> extract_params(AMX* amx, cell* params, uint8_t base_arg_count);
+	cell RunPythonThreadedEx(AMX *amx, cell *params);
+	cell CancelPythonCall(AMX *amx, cell *params);
+	cell GetPythonCallStatus(AMX *amx, cell *params);
+	cell SetPythonTimeout(AMX *amx, cell *params);
+	cell SetPythonCallTimeout(AMX *amx, cell *params);
+	cell GetPythonTimeouts(AMX *amx, cell *params);
+	cell GetPythonErrors(AMX *amx, cell *params);
+	cell GetPythonStats(AMX *amx, cell *params);
+	cell ReloadPythonModule(AMX *amx, cell *params);
+	cell GetPythonStat(AMX *amx, cell *params);
+	cell RunPythonBatch(AMX *amx, cell *params);
+	cell PyBatchBegin(AMX *amx, cell *params);
+	cell PyBatchAdd(AMX *amx, cell *params);
+	cell PyBatchSubmit(AMX *amx, cell *params);
+	cell SetPythonCacheTTL(AMX *amx, cell *params);
+	cell SetPythonCoalesce(AMX *amx, cell *params);
+	cell SetPythonCallbackBatched(AMX *amx, cell *params);
+	cell PreparePythonCall(AMX *amx, cell *params);
+	cell RunPreparedCall(AMX *amx, cell *params);
+	cell FreePreparedCall(AMX *amx, cell *params);
+	cell StartPythonTrace(AMX *amx, cell *params);
+	cell StopPythonTrace(AMX *amx, cell *params);
+
+	void extract_params(AMX* amx, cell* params, uint8_t base_arg_count, vector<Pawpy::pyarg_t>& arguments);
+	void extract_arguments(AMX* amx, cell* params, uint8_t base_arg_count, const string& argformat, vector<Pawpy::pyarg_t>& arguments);
+	vector<vector<Pawpy::pyarg_t>> extract_columns(AMX* amx, cell* params, uint8_t base_arg_count, cell count);
+	cell run_threaded(AMX* amx, cell* params, uint8_t offset, int priority);
+	bool valid_return_format(const string& return_format, const char* native);
+	bool valid_priority(cell priority);
+	bool valid_batch(const string& return_format, cell mode, const char* native);
+	void amx_unload(AMX* amx);
 };
 
 #endif
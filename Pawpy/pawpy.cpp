@@ -28,21 +28,36 @@
 
 #include <string>
 #include <vector>
-#include <stack>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <chrono>
-#include <mutex>
+#include <cstring>
 
 using std::string;
 using std::vector;
-using std::stack;
+using std::map;
+using std::unordered_map;
+using std::unordered_set;
 using std::thread;
-using std::mutex;
 
 #include "main.hpp"
 #include "python_meta.hpp"
 
 #include "pawpy.hpp"
+#include "pool.hpp"
+#include "process.hpp"
+#include "eventloop.hpp"
+#include "cache.hpp"
+#include "callstate.hpp"
+#include "watchdog.hpp"
+#include "metrics.hpp"
+#include "callables.hpp"
+#include "records.hpp"
+#include "ring.hpp"
+#include "trace.hpp"
+#include "errors.hpp"
 #include <amx/amx.h>
 #include <amx/amx2.h>
 #include <plugincommon.h>
@@ -50,342 +65,1461 @@ using std::mutex;
 
 /*
 	Note:
-	Contains a list of "pycall_t" objects that have finished processing. When a
-	thread has finished running a Python script, it will store the return value
-	inside the corresponding pycall_t object it is associated with then store
-	that object on this stack. When the AMX calls ProcessTick, it will process
-	whatever pycall_t objects are stored on it. This is the bread and butter of
-	thread-safe SA:MP plugins.
+	Contains "pycall_t" objects that have finished processing. When a worker
+	has finished running a Python script, it will store the return value
+	inside the corresponding pycall_t object it is associated with then push
+	that object onto this queue. When the AMX calls ProcessTick, it will
+	process whatever pycall_t objects are stored on it, oldest first. This is
+	the bread and butter of thread-safe SA:MP plugins.
+
+	It used to be a std::stack behind a mutex, but ProcessTick read it without
+	taking the lock and, being LIFO, the oldest results were starved whenever
+	results kept arriving. Workers now push without locking and ProcessTick
+	takes the whole batch in one atomic operation, see mpsc_queue.hpp.
 */
-stack<Pawpy::pycall_t> Pawpy::call_stack;
+Pawpy::mpsc_queue<Pawpy::pycall_t> Pawpy::call_queue;
 
 /*
 	Note:
-	This mutex protects the call_stack from race conditions. Since each Python
-	script runs in a thread, two scripts could finished at the same time and try
-	to write their processed pycall_t objects into the stack. This is standard
-	when working with threads, if you are unaware of mutexes and race conditions
-	please go read about these topics before touching threaded applications in
-	any language!
+	Everything the plugin keeps per AMX instance. backlog holds results taken
+	from call_queue that are waiting to be delivered to this AMX, publics maps
+	callback names to public indices so amx_FindPublic's string search only
+	happens once per callback. batched holds the callbacks that get all of a
+	tick's results in one call (see SetPythonCallbackBatched) and pending
+	collects those results during amx_tick, its vectors are kept between
+	ticks so they don't have to grow again. All of it is only touched by the
+	main thread and the entry is removed when the AMX unloads.
 */
-mutex Pawpy::call_stack_mutex;
+struct amx_state_t
+{
+	Pawpy::ring_queue<Pawpy::pycall_t> backlog;
+	unordered_map<string, int> publics;
+	unordered_set<string> batched;
+	unordered_map<string, vector<Pawpy::pycall_t>> pending;
+};
+
+static map<AMX*, amx_state_t> amx_states;
+
+/*
+	Note:
+	The main thread's Python thread state. The main thread gives up the GIL at
+	the end of Load and keeps its thread state here, RunPython swaps it back
+	in for each synchronous call and Unload takes it back to finalise the
+	interpreter.
+*/
+PyThreadState* Pawpy::main_thread_state = nullptr;
+
+/*
+	Note:
+	How often results didn't fit into a tick's time budget. backlog_deferred
+	counts every result that was carried over to a later tick (a result that
+	waits three ticks counts three times) and backlog_deferred_ticks counts
+	the ticks where the budget ran out.
+*/
+unsigned int Pawpy::backlog_deferred = 0;
+unsigned int Pawpy::backlog_deferred_ticks = 0;
+
+/*
+	Note:
+	What delivering callbacks costs the server. callback_execs counts every
+	amx_Exec made for a result (a batch is one), callback_batched counts the
+	results that went out in batches and callback_heap_peak is the most AMX
+	heap, in bytes, a single callback has needed. tick_time is how long the
+	last ProcessTick took in microseconds and tick_time_peak the longest.
+*/
+unsigned int Pawpy::callback_execs = 0;
+unsigned int Pawpy::callback_batched = 0;
+unsigned int Pawpy::callback_heap_peak = 0;
+unsigned int Pawpy::tick_time = 0;
+unsigned int Pawpy::tick_time_peak = 0;
 
 
 /*
 	Note:
-	Prepares a pycall_t object from input arguments.
+	Prepares a pycall_t object for a call, taken from the spare records (see
+	records.cpp). Only the main thread may call this. The arguments are left
+	for the caller to fill in, they still hold the last call's values so the
+	memory can be reused.
 */
-Pawpy::pycall_t Pawpy::prepare(string module, string function, string callback, vector<string> arguments)
+Pawpy::pycall_t Pawpy::prepare(name_t module, name_t function, name_t callback, name_t return_format)
 {
-	pycall_t call;
+	pycall_t call = record_acquire();
 
 	call.module = module;
 	call.function = function;
 	call.callback = callback;
-	call.arguments = arguments;
+	call.return_format = return_format;
+
+	if(tracing())
+		call.timing.entered = std::chrono::steady_clock::now();
 
 	return call;
 }
 
 /*
 	Note:
-	Creates a thread and runs the specified pycall_t object in that thread.
+	Wraps an 'm' or 'M' array in a read-only memoryview of C ints or floats,
+	which numpy.frombuffer or array.array can use without touching each item.
+	The cells are copied once into a bytes object that owns them, so Python
+	can keep the view for as long as it likes after the call has finished.
 */
-int Pawpy::run_python_threaded(pycall_t call)
+static PyObject* build_memoryview(const Pawpy::pyarg_t& arg)
 {
-	debug("run_python_threaded: %s, %s, %s", call.module.c_str(), call.function.c_str(), call.callback.c_str());
+	PyObject* bytes = PyBytes_FromStringAndSize(reinterpret_cast<const char*>(arg.cells.data()), arg.cells.size() * sizeof(cell));
 
-	thread* t = nullptr;
+	if(bytes == nullptr)
+		return nullptr;
 
-	debug("run_python_threaded: creating thread");
-	t = new thread(python_thread, call);
+	PyObject* view = PyMemoryView_FromObject(bytes);
+	Py_DECREF(bytes);
 
-	if(t == nullptr)
+	if(view == nullptr)
+		return nullptr;
+
+	PyObject* cast = PyObject_CallMethod(view, "cast", "s", arg.type == 'M' ? "f" : "i");
+	Py_DECREF(view);
+
+	return cast;
+}
+
+/*
+	Note:
+	Builds a str from a Pawn string, one character per cell. Characters above
+	127 often arrive sign-extended (a negative cell) because Pawn char arrays
+	are signed, those are masked back to the byte they came from. The widest
+	character decides the string's kind, so plain strings end up as compact
+	one-byte (Latin-1) Python strings.
+*/
+static PyObject* build_string(const Pawpy::pyarg_t& arg)
+{
+	Py_UCS4 maxchar = 0;
+
+	for(cell value : arg.cells)
 	{
-		samp_printf("ERROR: Unable to create thread for Python call.");
-		return 1;
+		Py_UCS4 character = value < 0 ? static_cast<unsigned char>(value) : value;
+
+		if(character > maxchar)
+			maxchar = character;
 	}
 
-	call.threadid = t->get_id();
+	PyObject* object = PyUnicode_New(arg.cells.size(), maxchar);
+
+	if(object == nullptr)
+		return nullptr;
+
+	int kind = PyUnicode_KIND(object);
+	void* data = PyUnicode_DATA(object);
 
-	t->detach();
+	for(size_t i = 0; i < arg.cells.size(); ++i)
+	{
+		cell value = arg.cells[i];
 
-	delete t;
+		PyUnicode_WRITE(kind, data, i, value < 0 ? static_cast<unsigned char>(value) : value);
+	}
 
-	return 0;
+	return object;
 }
 
 /*
 	Note:
-	This function runs inside a thread created from run_python_threaded. It
-	calls the Python main calling function and processes the result. When the
-	result is ready, it locks the call_stack and pushes the pycall_t object
-	ready for the next ProcessTick to call into the AMX with the result.
+	Turns one captured Pawn argument into a new Python object reference. Must
+	be called with the GIL held.
 */
-void Pawpy::python_thread(pycall_t pycall)
+PyObject* Pawpy::build_argument(const pyarg_t& arg)
 {
-	debug("run_call_thread: %s, %s, %s", pycall.module.c_str(), pycall.function.c_str(), pycall.callback.c_str());
+	PyObject* object = nullptr;
 
-	pycall.returns = run_python(pycall);
+	switch(arg.type)
+	{
+	case 'd':
+		object = PyLong_FromLong(arg.value);
+		break;
+
+	case 'f':
+		object = PyFloat_FromDouble(amx_ctof(arg.value));
+		break;
+
+	case 's':
+		object = build_string(arg);
+		break;
+
+	case 'a':
+		object = PyList_New(arg.cells.size());
+
+		if(object == nullptr)
+			break;
+
+		for(size_t i = 0; i < arg.cells.size(); ++i)
+		{
+			PyList_SET_ITEM(object, i, PyLong_FromLong(arg.cells[i]));
+		}
 
-	std::lock_guard<std::mutex> lock(call_stack_mutex);
-	call_stack.push(pycall);
+		break;
+
+	case 'm':
+	case 'M':
+		object = build_memoryview(arg);
+		break;
+	}
+
+	return object;
 }
 
 /*
 	Note:
-	This function takes a pycall_t object and runs the actual Python module it
-	specifies. It returns the result from the Python script which must be a
-	string. The code is quite daunting and most of it is converting and
-	validating types from C to Python.
+	Hands the specified pycall_t object to the worker pool. The pool has a
+	bounded queue so this can fail when the server is producing calls faster
+	than the workers can get through them. Returns the new call's ID, or 0 if
+	it couldn't be submitted.
+
+	While tracing, the time from the native being called to the call being
+	submitted is recorded too, the call itself is gone by then so what's
+	needed is copied out first.
 */
-string Pawpy::run_python(pycall_t pycall)
+cell Pawpy::run_python_threaded(pycall_t call)
 {
-	debug("run_call: %s, %s, %s", pycall.module.c_str(), pycall.function.c_str(), pycall.callback.c_str());
+	if(!tracing() || call.timing.entered == std::chrono::steady_clock::time_point())
+		return submit_threaded(std::move(call));
 
-	PyGILState_STATE gstate = PyGILState_Ensure();
-	debug("run_call: locked GIL state");
+	name_t module = call.module;
+	name_t function = call.function;
+	std::chrono::steady_clock::time_point entered = call.timing.entered;
+
+	cell id = submit_threaded(std::move(call));
+
+	trace_span("native", module, function, id, entered, std::chrono::steady_clock::now());
 
-	PyObject* name_ptr = PyUnicode_FromString(pycall.module.c_str());
+	return id;
+}
+
+cell Pawpy::submit_threaded(pycall_t&& call)
+{
+	debug("run_python_threaded: %s, %s, %s", call.module.c_str(), call.function.c_str(), call.callback.c_str());
 
-	if(name_ptr == nullptr)
+	call.timing.submitted = std::chrono::steady_clock::now();
+
+	/*
+		Note:
+		A cached result skips Python entirely and goes straight onto
+		call_queue, so the callback still fires on the next tick.
+	*/
+	if(call.batch.empty() && cache_lookup(call))
 	{
-        samp_pyerr();
-        samp_printf("ERROR: Failed to convert module name to PyUnicode object.");
-		return 0;
+		cell id = call_register(CALL_DONE, 0);
+
+		call.id = id;
+		call.timing.finished = call.timing.submitted;
+		call_queue.push(std::move(call));
+
+		return id;
 	}
 
 	/*
 		Note:
-		This gets the "cwd" (current working directory) and appends it to the
-		Python module search path (sys.path) so that .py files in the SA:MP
-		server directory are found. Because of Python's module abstraction,
-		scripts in subdirectories are specified by . as the directory delimiter
-		instead of a / character. I was going to hard-code a ./scripts/
-		directory since most users would probably want their scripts organised
-		in some way but I'll leave that up to users to decide.
+		Batches don't get the module's timeout, a batch is one job running
+		the function many times and the timeout is meant for a single call.
 	*/
-	char* cwd;
+	call.id = call_register(CALL_QUEUED, call.batch.empty() ? module_timeout(call.module) : 0);
 
-	cwd = GETCWD(NULL, 0);
+	cell id = call.id;
 
-	PyObject* sysPath = PySys_GetObject((char*)"path");
-	PyObject* programName = PyUnicode_FromString(cwd);
-	PyList_Append(sysPath, programName);
-	Py_DECREF(programName);
+	/*
+		Note:
+		An identical call is already on its way, this one just waits for
+		that result instead of running the function again.
+	*/
+	if(call.batch.empty() && flight_join(call))
+		return id;
 
-	delete cwd;
+	string flight = call.coalesced ? call.cache_key : string();
 
 	/*
 		Note:
-		Imports the module specified by pycall into the interpreter.
+		Batches always run on the worker threads since their items have to
+		share one GIL hold, which a worker process can't offer across the
+		ring without a batch message format of its own.
 	*/
-	PyObject* module_ptr = PyImport_Import(name_ptr);
+	if(process_enabled() && call.batch.empty())
+	{
+		if(!process_submit(std::move(call)))
+		{
+			flight_abort(flight);
+			call_forget(id);
+			record_release(std::move(call));
+			samp_printf("ERROR: Python worker process request ring is full, call dropped.");
+			return 0;
+		}
+
+		return id;
+	}
+
+	if(!pool_submit(std::move(call)))
+	{
+		flight_abort(flight);
+		call_forget(id);
+		record_release(std::move(call));
+		samp_printf("ERROR: Python job queue is full (%d calls waiting), call dropped.", pool_queue_depth);
+		return 0;
+	}
+
+	return id;
+}
+
+/*
+	Note:
+	This function runs inside one of the pool worker threads (see pool.cpp). It
+	calls the Python function and processes the result. When the
+	result is ready, it pushes the pycall_t object onto call_queue ready for
+	the next ProcessTick to call into the AMX with the result.
+*/
+void Pawpy::python_thread(pycall_t pycall)
+{
+	debug("run_call_thread: %s, %s, %s", pycall.module.c_str(), pycall.function.c_str(), pycall.callback.c_str());
 
-	if(module_ptr == nullptr)
+	pycall.timing.dequeued = std::chrono::steady_clock::now();
+
+	if(!pycall.batch.empty())
 	{
-        samp_pyerr();
-        samp_printf("ERROR: Failed to load module: '%s'", pycall.module.c_str());
-        return 0;
-    }
+		if(call_start(pycall.id))
+		{
+			python_batch(std::move(pycall));
+		}
+		else
+		{
+			call_forget(pycall.id);
+			record_return(std::move(pycall));
+		}
 
-	Py_DECREF(name_ptr);
-	debug("run_call: imported module '%s'", pycall.module.c_str());
+		return;
+	}
 
 	/*
 		Note:
-		Checks if the function specified in pycall exists in the loaded module.
+		A call cancelled while it was queued is dropped here and its record
+		handed back. One that other identical calls are waiting on still runs
+		for their sake, its own callback is suppressed later.
 	*/
-	name_ptr = PyUnicode_FromString(pycall.function.c_str());
-
-	if(PyObject_HasAttr(module_ptr, name_ptr) == NULL)
+	if(!call_start(pycall.id) && !pycall.coalesced)
 	{
-        samp_pyerr();
-        samp_printf("ERROR: Module has no attribute: '%s'", pycall.function.c_str());
-        return 0;
+		call_forget(pycall.id);
+		record_return(std::move(pycall));
+		return;
 	}
 
-	Py_DECREF(name_ptr);
-	debug("run_call: scanned for attribute '%s'", pycall.function.c_str());
+	pycall.threadid = std::this_thread::get_id();
 
 	/*
 		Note:
-		Loads the function specified in pycall into a PyObject ready to call.
+		Workers already own a thread state (see pool.cpp) which may belong to
+		their own subinterpreter, so the GIL is taken with that rather than
+		through PyGILState_Ensure, which only knows about the main interpreter.
 	*/
-	PyObject* func_ptr = nullptr;
+	PyEval_RestoreThread(worker_thread_state);
+	debug("run_call: locked GIL state");
 
-	func_ptr = PyObject_GetAttr(module_ptr, name_ptr);
+	pycall.timing.acquired = std::chrono::steady_clock::now();
 
-	if(func_ptr == nullptr)
-	{
-        samp_pyerr();
-        samp_printf("ERROR: Failed to convert function name to function object: '%s'", pycall.function.c_str());
-        return 0;
-	}
+	cell id = pycall.id;
+
+	pycall.timeout = call_bind(id);
+
+	PyObject* result = invoke_python(pycall);
 
 	/*
 		Note:
-		Checks if this is a "callable" object. Everything is an object in Python
-		so the "attribute" we loaded earlier could actually be a class or a
-		variable so this check ensures it's something we can "call".
+		An async def function is handed to the event loop and the worker is
+		free straight away, the loop pushes the call onto call_queue itself
+		once the coroutine is done.
 	*/
-	if(!PyCallable_Check(func_ptr))
+	if(result != nullptr && PyCoro_CheckExact(result) && loop_submit(result, pycall))
 	{
-        samp_pyerr();
-        samp_printf("ERROR: Function not found or is not callable: '%s'", pycall.function.c_str());
-        return 0;
+		call_unbind(id);
+		worker_thread_state = PyEval_SaveThread();
+		return;
 	}
 
-	debug("run_call: checked for function existence and callability '%s'", pycall.function.c_str());
+	pycall.failed = !finish_python(result, pycall);
 
 	/*
 		Note:
-		This tuple contains the arguments we're passing to the Python function.
+		A function that catches the TimeoutError and returns anyway still
+		counts as timed out, its result arrived too late to be trusted.
 	*/
-	PyObject* args_ptr = PyTuple_New(pycall.arguments.size());
-
-	if(args_ptr == nullptr)
+	if(call_unbind(id))
 	{
-        samp_pyerr();
-        samp_printf("ERROR: Failed to create new PyTuple object.");
-        return 0;
+		samp_printf("ERROR: Python function '%s.%s' timed out after %dms.", pycall.module.c_str(), pycall.function.c_str(), pycall.timeout);
+		pycall.timed_out = true;
+		pycall.failed = true;
+		pycall.returns.clear();
+		pycall.results.clear();
 	}
 
-	PyObject* arg_string_ptr;
+	pycall.timing.finished = std::chrono::steady_clock::now();
 
-	for(unsigned int i = 0; i < pycall.arguments.size(); ++i)
-	{
-		arg_string_ptr = PyUnicode_FromString(pycall.arguments[i].c_str());
-		PyTuple_SET_ITEM(args_ptr, i, arg_string_ptr);
-	}
+	worker_thread_state = PyEval_SaveThread();
+	debug("run_call: released GIL state");
 
-	debug("run_call: created argument tuple");
+	if(tracing())
+		trace_worker(pycall);
 
-	/*
-		Todo: process arguments of various types from Pawn call.
+	metrics_execution(pycall);
 
-		Loop args, PyLong_FromLong/String/Array then PyTuple_SetItem, etc.
-	*/
+	call_queue.push(std::move(pycall));
+}
 
-	debug("run_call: calling into Python module '%s' at function '%s'", pycall.module.c_str(), pycall.function.c_str());
+/*
+	Note:
+	Runs every item of a batch job in one GIL hold, which is the whole point
+	of a batch: scripts that call the same function for every player pay for
+	one job, one queue slot and one GIL acquisition instead of hundreds.
+
+	Items are run as ordinary calls. Without batch_single each one is pushed
+	onto call_queue as soon as it finishes and gets its own callback, they all
+	carry the batch's ID so cancelling it stops the ones still to come. With
+	batch_single the single value each item returns is collected into one
+	array and the callback is called once as (results[], count, failures),
+	items that failed are left as 0 in the array.
+*/
+void Pawpy::python_batch(pycall_t pycall)
+{
+	debug("python_batch: %s, %s, %d items", pycall.module.c_str(), pycall.function.c_str(), pycall.batch.size());
 
-	/*
-		Note:
-		The actual function call. The function and arguments that were prepared
-		and validated earlier are passed in and everything should run smoothly.
-	*/
-	PyObject* result_ptr = PyObject_CallObject(func_ptr, args_ptr);
-	Py_DECREF(args_ptr);
+	pycall_t item;
+	pyarg_t values;
+	pyarg_t failures;
 
-	debug("run_call: finished running Python module");
+	values.type = 'a';
+	values.value = pycall.batch.size();
+	values.cells.assign(pycall.batch.size(), 0);
 
-	if(result_ptr == nullptr)
+	failures.type = 'd';
+	failures.value = 0;
+
+	PyEval_RestoreThread(worker_thread_state);
+
+	pycall.timing.acquired = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i < pycall.batch.size(); ++i)
 	{
-		samp_pyerr();
-		samp_printf("ERROR: Python function call result is null.");
-        return 0;
+		record_reset(item);
+		item.module = pycall.module;
+		item.function = pycall.function;
+		item.callback = pycall.callback;
+		item.return_format = pycall.return_format;
+		item.arguments = std::move(pycall.batch[i]);
+		item.amx = pycall.amx;
+		item.id = pycall.id;
+		item.batch_more = i + 1 < pycall.batch.size();
+		item.threadid = std::this_thread::get_id();
+		item.failed = !call_python(item);
+		item.timing = pycall.timing;
+		item.timing.finished = std::chrono::steady_clock::now();
+
+		if(!pycall.batch_single)
+		{
+			call_queue.push(std::move(item));
+			continue;
+		}
+
+		if(item.failed)
+			failures.value++;
+		else
+			values.cells[i] = item.results[0].value;
 	}
 
+	pycall.timing.finished = std::chrono::steady_clock::now();
+
+	worker_thread_state = PyEval_SaveThread();
+
+	if(tracing())
+		trace_worker(pycall);
+
 	/*
 		Note:
-		Gets the return value of the result from the call. Return value must be
-		a string, simply because type conversion is easier when there's only one
-		type to deal with.
+		The whole batch is recorded as one execution, it's one job for the
+		pool and one GIL hold.
 	*/
-	PyObject* result_str_ptr = PyUnicode_AsASCIIString(result_ptr);
-	if(result_str_ptr == nullptr)
+	metrics_execution(pycall);
+
+	if(!pycall.batch_single)
 	{
-		samp_pyerr();
-		samp_printf("ERROR: Python function call result is not a string.");
-        return 0;
+		record_return(std::move(pycall));
+		return;
 	}
 
-	char* result_str_char;// = PyByteArray_AsString(result_str_ptr);
-	Py_ssize_t result_str_len;
-	PyBytes_AsStringAndSize(result_str_ptr, &result_str_char, &result_str_len);
-	Py_DECREF(result_str_ptr);
+	pycall.batch.clear();
+	pycall.threadid = std::this_thread::get_id();
+	pycall.failed = false;
+	pycall.results.push_back(std::move(values));
+	pycall.results.push_back(std::move(failures));
+
+	call_queue.push(std::move(pycall));
+}
 
-	if(result_str_char == nullptr)
+/*
+	Note:
+	Reads item i of a buffer with the given struct format character as an int
+	or a float, for buffers that don't already hold 32-bit values.
+*/
+template <typename T>
+static T buffer_item(const char* data, char format, Py_ssize_t i)
+{
+	switch(format)
 	{
-		samp_pyerr();
-		samp_printf("ERROR: result_str_char is null.");
-        return 0;
+	case 'b': return static_cast<T>(reinterpret_cast<const signed char*>(data)[i]);
+	case 'B': return static_cast<T>(reinterpret_cast<const unsigned char*>(data)[i]);
+	case 'h': return static_cast<T>(reinterpret_cast<const short*>(data)[i]);
+	case 'H': return static_cast<T>(reinterpret_cast<const unsigned short*>(data)[i]);
+	case 'i': return static_cast<T>(reinterpret_cast<const int*>(data)[i]);
+	case 'I': return static_cast<T>(reinterpret_cast<const unsigned int*>(data)[i]);
+	case 'l': return static_cast<T>(reinterpret_cast<const long*>(data)[i]);
+	case 'L': return static_cast<T>(reinterpret_cast<const unsigned long*>(data)[i]);
+	case 'q': return static_cast<T>(reinterpret_cast<const long long*>(data)[i]);
+	case 'Q': return static_cast<T>(reinterpret_cast<const unsigned long long*>(data)[i]);
+	case 'f': return static_cast<T>(reinterpret_cast<const float*>(data)[i]);
+	case 'd': return static_cast<T>(reinterpret_cast<const double*>(data)[i]);
 	}
 
-	debug("run_call: optained module result value '%s' and returning", result_str_char);
+	return T();
+}
 
-	PyGILState_Release(gstate);
-	debug("run_call: released GIL state");
+/*
+	Note:
+	Copies an 'm' (int) or 'M' (float) array result out of any object that
+	supports the buffer protocol: a memoryview, array.array, bytearray or
+	numpy array. When the items are already 32-bit ints or floats, as with
+	numpy.int32 and numpy.float32 arrays, the whole block is copied with one
+	memcpy. Other numeric item types are converted one at a time, which is
+	still far cheaper than going through a Python object per item.
+*/
+static bool extract_buffer(PyObject* object, char type, Pawpy::pyarg_t& out)
+{
+	Py_buffer view;
+
+	if(PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+		return false;
+
+	const char* format = view.format != nullptr ? view.format : "B";
+
+	if(*format == '@' || *format == '=' || *format == '<')
+		format++;
+
+	if(format[0] == '\0' || format[1] != '\0' || strchr("bBhHiIlLqQfd", format[0]) == nullptr)
+	{
+		PyErr_Format(PyExc_TypeError, "unsupported buffer format '%s' for return format '%c'", view.format, type);
+		PyBuffer_Release(&view);
+		return false;
+	}
+
+	Py_ssize_t length = view.itemsize > 0 ? view.len / view.itemsize : 0;
+	const char* data = static_cast<const char*>(view.buf);
+	bool is_float = format[0] == 'f' || format[0] == 'd';
+
+	out.value = length;
+	out.cells.resize(length);
+
+	if(view.itemsize == sizeof(cell) && is_float == (type == 'M'))
+	{
+		memcpy(out.cells.data(), data, length * sizeof(cell));
+	}
+	else if(type == 'M')
+	{
+		for(Py_ssize_t i = 0; i < length; ++i)
+		{
+			float value = buffer_item<float>(data, format[0], i);
+			out.cells[i] = amx_ftoc(value);
+		}
+	}
+	else
+	{
+		for(Py_ssize_t i = 0; i < length; ++i)
+			out.cells[i] = buffer_item<cell>(data, format[0], i);
+	}
+
+	PyBuffer_Release(&view);
 
-	return string(result_str_char);
+	return true;
 }
 
 /*
 	Note:
-	This is a ProcessTick function called for each AMX instance (see main.cpp)
-	The call_stack is checked for contents; when call_stack contains objects,
-	they are looped and processed in the order they were pushed. For each pycall
-	the AMX code searches for the public callback function, pushes the result
-	stored in the pycall object from the end of run_call onto the parameters and
-	calls the function in Pawn, the circle is complete!
+	Converts one Python value into a pyarg_t for the given return format
+	specifier. Must be called with the GIL held and a Python exception is set
+	whenever it returns false. Strings are stored with their terminating zero
+	cell so they can be pushed into the AMX as-is.
 */
-void Pawpy::amx_tick(AMX* amx)
+static bool extract_result_value(PyObject* object, char type, Pawpy::pyarg_t& out)
 {
-	if(call_stack.empty())
-		return;
+	out.type = type;
+	out.value = 0;
+	out.cells.clear();
 
-	Pawpy::pycall_t call;
-	int error = 0;
-	int amx_idx = -1;
-	cell amx_addr;
-	cell amx_ret;
-	cell *phys_addr; 
+	switch(type)
+	{
+	case 'd':
+	{
+		long value = PyLong_AsLong(object);
 
-	while(!Pawpy::call_stack.empty())
+		if(value == -1 && PyErr_Occurred())
+			return false;
+
+		out.value = value;
+		return true;
+	}
+
+	case 'f':
 	{
-		call = Pawpy::call_stack.top();
+		float value = static_cast<float>(PyFloat_AsDouble(object));
+
+		if(value == -1.0f && PyErr_Occurred())
+			return false;
 
-		error = amx_FindPublic(amx, call.callback.c_str(), &amx_idx);
+		out.value = amx_ftoc(value);
+		return true;
+	}
 
-		if(error == AMX_ERR_NONE)
+	case 's':
+	{
+		if(!PyUnicode_Check(object))
 		{
-			debug("amx_tick: callback: %s, %s, %s", call.module.c_str(), call.function.c_str(), call.callback.c_str());
+			PyErr_SetString(PyExc_TypeError, "expected a str for return format 's'");
+			return false;
+		}
+
+		Py_ssize_t length = PyUnicode_GetLength(object);
 
-			/*
-				Note:
-				Callback parameters are pushed in reverse order. So in this case
-				call.returns is the last parameter in the Pawn native, but here
-				it is pushed first.
-				The callback parameter format is: (string[], len)
-			*/
-			amx_Push(amx, call.returns.length());
-			amx_PushString(amx, &amx_addr, &phys_addr, call.returns.c_str(), 0, 0);
-			amx_PushString(amx, &amx_addr, &phys_addr, call.module.c_str(), 0, 0);
+		out.value = length;
+		out.cells.resize(length + 1);
 
-			amx_Exec(amx, &amx_ret, amx_idx);
-			amx_Release(amx, amx_addr);
+		if(PyUnicode_AsUCS4(object, reinterpret_cast<Py_UCS4*>(out.cells.data()), length + 1, 1) == nullptr)
+			return false;
 
-			debug("amx_tick: callback return value: %d", amx_ret);
+		return true;
+	}
+
+	case 'a':
+	case 'v':
+	{
+		PyObject* sequence = PySequence_Fast(object, "expected a list or tuple for an array return value");
+
+		if(sequence == nullptr)
+			return false;
 
-			std::this_thread::sleep_for(std::chrono::duration<int, std::ratio<1>>(1));
+		Py_ssize_t length = PySequence_Fast_GET_SIZE(sequence);
+		PyObject** items = PySequence_Fast_ITEMS(sequence);
+
+		out.value = length;
+		out.cells.resize(length);
+
+		for(Py_ssize_t i = 0; i < length; ++i)
+		{
+			if(type == 'a')
+			{
+				out.cells[i] = PyLong_AsLong(items[i]);
+			}
+			else
+			{
+				float value = static_cast<float>(PyFloat_AsDouble(items[i]));
+				out.cells[i] = amx_ftoc(value);
+			}
 
-			if(amx_ret > 0)
+			if(PyErr_Occurred())
 			{
-				debug("amx_tick: callback returned 1, re-running Python call in %d ms", amx_ret);
-				/*
-					Note:
-					Doesn't quite work yet, some kind of memory leak making this
-					kind of inter-thread recursion problematic...
-				*/
-				//run_python_threaded(call);
+				Py_DECREF(sequence);
+				return false;
 			}
+		}
+
+		Py_DECREF(sequence);
+		return true;
+	}
+
+	case 'm':
+	case 'M':
+		return extract_buffer(object, type, out);
+	}
+
+	PyErr_Format(PyExc_ValueError, "invalid return format specifier '%c'", type);
+	return false;
+}
+
+/*
+	Note:
+	Stores the value returned by the Python function in the pycall_t object.
+	Without a return format the result must be a string, simply because type
+	conversion is easier when there's only one type to deal with. With one,
+	each specifier takes one value from the returned tuple or list, or the
+	returned value itself when there's only one specifier.
+*/
+static bool extract_result(PyObject* result_ptr, Pawpy::pycall_t& pycall)
+{
+	if(pycall.return_format.empty())
+	{
+		PyObject* result_str_ptr = PyUnicode_AsASCIIString(result_ptr);
 
+		if(result_str_ptr == nullptr)
+		{
+			Pawpy::error_report(pycall.module, pycall.function, "Python function '%s' result is not a string.", pycall.function.c_str());
+			return false;
 		}
-		else
+
+		/*
+			Note:
+			The result is copied out before the bytes object is released, the
+			buffer belongs to that object and may be reused as soon as it's gone.
+		*/
+		char* result_str_char;
+		Py_ssize_t result_str_len;
+		PyBytes_AsStringAndSize(result_str_ptr, &result_str_char, &result_str_len);
+
+		pycall.returns.assign(result_str_char, result_str_len);
+		Py_DECREF(result_str_ptr);
+
+		debug("run_call: optained module result value '%s'", pycall.returns.c_str());
+
+		return true;
+	}
+
+	pycall.results.resize(pycall.return_format.length());
+
+	if(pycall.return_format.length() == 1)
+	{
+		if(!extract_result_value(result_ptr, pycall.return_format[0], pycall.results[0]))
+		{
+			Pawpy::error_report(pycall.module, pycall.function, "Python function '%s' result doesn't match return format '%s'.", pycall.function.c_str(), pycall.return_format.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	PyObject* sequence = PySequence_Fast(result_ptr, "expected a tuple or list of return values");
+
+	if(sequence == nullptr)
+	{
+		Pawpy::error_report(pycall.module, pycall.function, "Python function '%s' must return a tuple or list for return format '%s'.", pycall.function.c_str(), pycall.return_format.c_str());
+		return false;
+	}
+
+	if(static_cast<size_t>(PySequence_Fast_GET_SIZE(sequence)) != pycall.return_format.length())
+	{
+		Pawpy::error_report(pycall.module, pycall.function, "Python function '%s' returned %d values, return format '%s' expects %d.",
+			pycall.function.c_str(), PySequence_Fast_GET_SIZE(sequence), pycall.return_format.c_str(), pycall.return_format.length());
+		Py_DECREF(sequence);
+		return false;
+	}
+
+	PyObject** items = PySequence_Fast_ITEMS(sequence);
+
+	for(size_t i = 0; i < pycall.return_format.length(); ++i)
+	{
+		if(!extract_result_value(items[i], pycall.return_format[i], pycall.results[i]))
 		{
-			samp_printf("ERROR: amx_FindPublic returned %d.", error);
+			Pawpy::error_report(pycall.module, pycall.function, "Python function '%s' return value %d doesn't match return format '%c'.", pycall.function.c_str(), i, pycall.return_format[i]);
+			Py_DECREF(sequence);
+			return false;
 		}
+	}
+
+	Py_DECREF(sequence);
+
+	return true;
+}
+
+/*
+	Note:
+	This function takes a pycall_t object and runs the actual Python module it
+	specifies. The result from the Python script is stored in the pycall_t
+	object, see extract_result. Returns false if anything went wrong, the
+	error has already been printed by then.
 
-		Pawpy::call_stack.pop();
+	The caller must hold the GIL, see python_thread and run_python_main.
+*/
+bool Pawpy::call_python(pycall_t& pycall)
+{
+	return finish_python(invoke_python(pycall), pycall);
+}
+
+/*
+	Note:
+	Calls the function a pycall_t specifies and returns a new reference to
+	whatever it returned, or nullptr if the call couldn't be made or raised.
+	The code is quite daunting and most of it is converting and validating
+	types from C to Python. For an async def function the result is the
+	coroutine object, nothing has actually run yet.
+*/
+PyObject* Pawpy::invoke_python(pycall_t& pycall)
+{
+	debug("run_call: %s, %s, %s", pycall.module.c_str(), pycall.function.c_str(), pycall.callback.c_str());
+
+	/*
+		Note:
+		Gets the function object from the cache, the first call to a function
+		imports its module and looks it up, every call after that is just a
+		map lookup.
+	*/
+	PyObject* func_ptr = resolve_callable(pycall.module, pycall.function);
+
+	if(func_ptr == nullptr)
+	{
+		return nullptr;
 	}
+
+	if(tracing())
+		pycall.timing.resolved = std::chrono::steady_clock::now();
+
+	debug("run_call: resolved callable '%s.%s'", pycall.module.c_str(), pycall.function.c_str());
+
+	/*
+		Note:
+		This tuple contains the arguments we're passing to the Python function.
+	*/
+	PyObject* args_ptr = PyTuple_New(pycall.arguments.size());
+
+	if(args_ptr == nullptr)
+	{
+		samp_pyerr();
+		samp_printf("ERROR: Failed to create new PyTuple object.");
+		Py_DECREF(func_ptr);
+		return nullptr;
+	}
+
+	PyObject* arg_ptr;
+
+	for(unsigned int i = 0; i < pycall.arguments.size(); ++i)
+	{
+		arg_ptr = build_argument(pycall.arguments[i]);
+
+		if(arg_ptr == nullptr)
+		{
+			error_report(pycall.module, pycall.function, "Failed to convert argument %d of type '%c'.", i, pycall.arguments[i].type);
+			Py_DECREF(args_ptr);
+			Py_DECREF(func_ptr);
+			return nullptr;
+		}
+
+		PyTuple_SET_ITEM(args_ptr, i, arg_ptr);
+	}
+
+	debug("run_call: created argument tuple");
+
+	debug("run_call: calling into Python module '%s' at function '%s'", pycall.module.c_str(), pycall.function.c_str());
+
+	/*
+		Note:
+		The actual function call. The function and arguments that were prepared
+		and validated earlier are passed in and everything should run smoothly.
+	*/
+	PyObject* result_ptr = PyObject_CallObject(func_ptr, args_ptr);
+	Py_DECREF(args_ptr);
+	Py_DECREF(func_ptr);
+
+	debug("run_call: finished running Python module");
+
+	if(result_ptr == nullptr)
+	{
+		error_report(pycall.module, pycall.function, "Python function '%s.%s' raised an exception.", pycall.module.c_str(), pycall.function.c_str());
+	}
+
+	return result_ptr;
+}
+
+/*
+	Note:
+	Stores a result from invoke_python in the pycall_t and releases it, a null
+	result is a call that already failed. A coroutine that reaches this point
+	wasn't given to the event loop (see eventloop.cpp) so it's simply run to
+	completion here, blocking the calling thread like any other function.
+*/
+bool Pawpy::finish_python(PyObject* result_ptr, pycall_t& pycall)
+{
+	if(result_ptr == nullptr)
+		return false;
+
+	if(PyCoro_CheckExact(result_ptr))
+	{
+		result_ptr = run_coroutine(result_ptr);
+
+		if(result_ptr == nullptr)
+		{
+			error_report(pycall.module, pycall.function, "Python coroutine '%s.%s' failed.", pycall.module.c_str(), pycall.function.c_str());
+			return false;
+		}
+	}
+
+	bool success = extract_result(result_ptr, pycall);
+	Py_DECREF(result_ptr);
+
+	return success;
+}
+
+/*
+	Note:
+	Runs a call directly on the server's main thread for RunPython. This swaps
+	the cached main thread state in and out instead of going through the
+	PyGILState API, it's the cheapest way to take the GIL from a thread that
+	already has a thread state. The main thread still has to wait if a worker
+	is holding the GIL, which is why RunPython is meant for short functions.
+*/
+bool Pawpy::run_python_main(pycall_t& pycall)
+{
+	PyEval_RestoreThread(main_thread_state);
+
+	bool success = call_python(pycall);
+
+	main_thread_state = PyEval_SaveThread();
+
+	return success;
+}
+
+/*
+	Note:
+	Pushes typed results onto the AMX stack for a callback. Parameters are
+	pushed in reverse order and arrays are followed by their size, the same
+	way array arguments are passed to Python. heap_addr is set to the first
+	(lowest) heap address allocated so the caller can release everything
+	with one amx_Release.
+*/
+static void push_results(AMX* amx, const vector<Pawpy::pyarg_t>& results, cell& heap_addr, bool& heap_used)
+{
+	cell amx_addr;
+
+	for(auto it = results.rbegin(); it != results.rend(); ++it)
+	{
+		switch(it->type)
+		{
+		case 'd':
+		case 'f':
+			amx_Push(amx, it->value);
+			continue;
+
+		case 'a':
+		case 'v':
+		case 'm':
+		case 'M':
+			amx_Push(amx, it->value);
+			break;
+		}
+
+		amx_PushArray(amx, &amx_addr, nullptr, it->cells.data(), it->cells.size());
+
+		if(!heap_used)
+		{
+			heap_addr = amx_addr;
+			heap_used = true;
+		}
+	}
+}
+
+/*
+	Note:
+	Fills in a zero value for every return format specifier, for callbacks
+	of calls that timed out before returning anything.
+*/
+static void empty_results(Pawpy::pycall_t& call)
+{
+	call.results.assign(call.return_format.length(), Pawpy::pyarg_t());
+
+	for(size_t i = 0; i < call.return_format.length(); ++i)
+	{
+		call.results[i].type = call.return_format[i];
+		call.results[i].value = 0;
+
+		if(call.return_format[i] != 'd' && call.return_format[i] != 'f')
+			call.results[i].cells.assign(1, 0);
+	}
+}
+
+/*
+	Note:
+	Called from AmxLoad and AmxUnload. Results for an AMX that has unloaded
+	are dropped, along with its cached public indices since a new AMX may be
+	loaded at the same address.
+*/
+void Pawpy::amx_load(AMX* amx)
+{
+	amx_states[amx];
+}
+
+void Pawpy::amx_unload(AMX* amx)
+{
+	amx_states.erase(amx);
+}
+
+void Pawpy::amx_set_batched(AMX* amx, const string& callback, bool batched)
+{
+	amx_state_t& state = amx_states[amx];
+
+	if(batched)
+	{
+		state.batched.insert(callback);
+	}
+	else
+	{
+		state.batched.erase(callback);
+		state.pending.erase(callback);
+	}
+}
+
+/*
+	Note:
+	Every item of a batch without batch_single shares the batch's call ID, so
+	only the last one may finish or forget the call. The others are only
+	wanted while the call is still known and hasn't been cancelled, it's gone
+	once the last item was dropped because of a cancel.
+*/
+static bool batch_item_wanted(const Pawpy::pycall_t& call)
+{
+	Pawpy::call_status_t status = Pawpy::call_status(call.id);
+
+	return status != Pawpy::CALL_NONE && status != Pawpy::CALL_CANCELLED;
+}
+
+static void forget_call(const Pawpy::pycall_t& call)
+{
+	if(!call.batch_more)
+		Pawpy::call_forget(call.id);
+}
+
+/*
+	Note:
+	Called once per ProcessTick before any AMX is ticked. Finished calls are
+	moved from call_queue (and the worker processes, if enabled) in one go,
+	stored in the result cache, fanned out to any identical calls that were
+	waiting on them and then sorted into the backlog of the AMX each call
+	came from. finished is kept between ticks so it doesn't have to grow
+	again.
+*/
+void Pawpy::collect_results()
+{
+	static ring_queue<pycall_t> finished;
+
+	process_drain(finished);
+	call_queue.drain(finished);
+
+	Pawpy::pycall_t call;
+
+	while(!finished.empty())
+	{
+		call = std::move(finished.front());
+		finished.pop_front();
+
+		/*
+			Note:
+			Calls that were waiting on a call that timed out are told they
+			timed out too, but only the one that actually ran (the only one
+			with a timeout of its own) is counted.
+		*/
+		if(call.timed_out && call.timeout > 0)
+			record_timeout();
+
+		/*
+			Note:
+			Results from worker processes and calls that shared another
+			call's result have no finish time of their own.
+		*/
+		if(call.timing.finished == std::chrono::steady_clock::time_point())
+		{
+			call.timing.finished = std::chrono::steady_clock::now();
+
+			if(tracing())
+				trace_async("elsewhere", call.module, call.function, call.id, call.timing.submitted, call.timing.finished);
+		}
+
+		metrics_result(call);
+		errors_result(call);
+
+		cache_store(call);
+		flight_land(call, finished);
+
+		if(call.batch_more ? !batch_item_wanted(call) : !call_finish(call.id, call.timed_out))
+		{
+			debug("collect_results: dropping cancelled call %d", call.id);
+			record_release(std::move(call));
+			continue;
+		}
+
+		auto state = amx_states.find(call.amx);
+
+		if(state == amx_states.end())
+		{
+			debug("collect_results: dropping result of '%s' for an unloaded AMX", call.callback.c_str());
+			forget_call(call);
+			record_release(std::move(call));
+			continue;
+		}
+
+		state->second.backlog.push_back(std::move(call));
+	}
+}
+
+/*
+	Note:
+	Finds a callback's public index, only asking the AMX the first time each
+	name is used. Unknown names aren't cached so the error is printed every
+	time, that's a bug in the script that should stay visible.
+*/
+static int find_public(AMX* amx, amx_state_t& state, const string& callback)
+{
+	auto found = state.publics.find(callback);
+
+	if(found != state.publics.end())
+		return found->second;
+
+	int index = -1;
+	int error = amx_FindPublic(amx, callback.c_str(), &index);
+
+	if(error != AMX_ERR_NONE)
+	{
+		samp_printf("ERROR: amx_FindPublic returned %d for callback '%s'.", error, callback.c_str());
+		return -1;
+	}
+
+	state.publics[callback] = index;
+
+	return index;
+}
+
+/*
+	Note:
+	Records how much of the AMX heap a callback's parameters took, heap_start
+	is the heap top from before anything was pushed.
+*/
+static void record_heap(AMX* amx, cell heap_start)
+{
+	unsigned int used = amx->hea - heap_start;
+
+	if(used > Pawpy::callback_heap_peak)
+		Pawpy::callback_heap_peak = used;
+}
+
+/*
+	Note:
+	Calls a result's callback. Callback parameters are pushed in reverse
+	order. So in this case call.returns is the last parameter in the Pawn
+	native, but here it is pushed first.
+	Without a return format the callback parameter format is:
+	(module[], string[], len), with one it's the typed values.
+	Everything pushed is allocated on the AMX heap in order, so releasing the
+	first allocation frees all of them.
+	The call ID is always the last parameter, callbacks that don't declare it
+	simply never see it.
+*/
+static void deliver_result(AMX* amx, int amx_idx, Pawpy::pycall_t& call)
+{
+	cell amx_addr;
+	cell amx_ret;
+	cell *phys_addr;
+	cell heap_addr;
+	cell heap_start = amx->hea;
+	bool heap_used = false;
+	std::chrono::steady_clock::time_point start;
+
+	debug("amx_tick: callback: %s, %s, %s", call.module.c_str(), call.function.c_str(), call.callback.c_str());
+
+	if(Pawpy::tracing())
+		start = std::chrono::steady_clock::now();
+
+	Pawpy::metrics_delivery(call);
+
+	amx_Push(amx, call.id);
+
+	if(call.return_format.empty())
+	{
+		amx_Push(amx, call.returns.length());
+		amx_PushString(amx, &amx_addr, &phys_addr, call.returns.c_str(), 0, 0);
+		heap_addr = amx_addr;
+		heap_used = true;
+		amx_PushString(amx, &amx_addr, &phys_addr, call.module.c_str(), 0, 0);
+	}
+	else
+	{
+		push_results(amx, call.results, heap_addr, heap_used);
+	}
+
+	record_heap(amx, heap_start);
+
+	amx_Exec(amx, &amx_ret, amx_idx);
+	Pawpy::callback_execs++;
+
+	if(heap_used)
+		amx_Release(amx, heap_addr);
+
+	if(Pawpy::tracing())
+		Pawpy::trace_delivery(call, start);
+
+	debug("amx_tick: callback return value: %d", amx_ret);
+
+	if(amx_ret > 0)
+	{
+		debug("amx_tick: callback returned 1, re-running Python call in %d ms", amx_ret);
+		/*
+			Note:
+			Doesn't quite work yet, some kind of memory leak making this
+			kind of inter-thread recursion problematic...
+		*/
+		//run_python_threaded(call);
+	}
+}
+
+/*
+	Note:
+	Writes one result into a batch's data array, or just counts the cells it
+	needs when out is null. A string result is its characters and a zero, a
+	typed result is its values in order: one cell for 'd' and 'f', the
+	characters and a zero for 's' and the size followed by the items for the
+	array types.
+*/
+static size_t pack_result(const Pawpy::pycall_t& call, cell* out)
+{
+	size_t size = 0;
+
+	if(call.return_format.empty())
+	{
+		if(out != nullptr)
+		{
+			for(size_t i = 0; i < call.returns.length(); ++i)
+				out[i] = static_cast<unsigned char>(call.returns[i]);
+
+			out[call.returns.length()] = 0;
+		}
+
+		return call.returns.length() + 1;
+	}
+
+	for(auto& result : call.results)
+	{
+		switch(result.type)
+		{
+		case 'd':
+		case 'f':
+			if(out != nullptr)
+				out[size] = result.value;
+
+			size++;
+			break;
+
+		case 's':
+			if(out != nullptr)
+				memcpy(out + size, result.cells.data(), result.cells.size() * sizeof(cell));
+
+			size += result.cells.size();
+			break;
+
+		default:
+			if(out != nullptr)
+			{
+				out[size] = result.value;
+				memcpy(out + size + 1, result.cells.data(), result.value * sizeof(cell));
+			}
+
+			size += result.value + 1;
+			break;
+		}
+	}
+
+	return size;
+}
+
+/*
+	Note:
+	Calls a batched callback once for calls[first, last) as
+	(ids[], offsets[], data[], count), where result i starts at
+	data[offsets[i]]. All three arrays are one heap allocation, released with
+	one amx_Release. If the AMX heap is too small for all of them the batch is
+	split in half until it fits.
+*/
+static void deliver_batch(AMX* amx, int amx_idx, vector<Pawpy::pycall_t>& calls, size_t first, size_t last)
+{
+	size_t count = last - first;
+	size_t data_size = 0;
+
+	for(size_t i = first; i < last; ++i)
+		data_size += pack_result(calls[i], nullptr);
+
+	cell amx_addr;
+	cell amx_ret;
+	cell* phys_addr;
+	cell heap_start = amx->hea;
+	std::chrono::steady_clock::time_point start;
+
+	if(Pawpy::tracing())
+		start = std::chrono::steady_clock::now();
+
+	if(amx_Allot(amx, count * 2 + data_size, &amx_addr, &phys_addr) != AMX_ERR_NONE)
+	{
+		if(count > 1)
+		{
+			deliver_batch(amx, amx_idx, calls, first, first + count / 2);
+			deliver_batch(amx, amx_idx, calls, first + count / 2, last);
+		}
+		else
+		{
+			samp_printf("ERROR: Not enough AMX heap for the result of call %d to '%s'.", calls[first].id, calls[first].callback.c_str());
+		}
+
+		return;
+	}
+
+	cell* ids = phys_addr;
+	cell* offsets = phys_addr + count;
+	cell* data = phys_addr + count * 2;
+	size_t offset = 0;
+
+	for(size_t i = 0; i < count; ++i)
+	{
+		Pawpy::pycall_t& call = calls[first + i];
+
+		Pawpy::metrics_delivery(call);
+
+		ids[i] = call.id;
+		offsets[i] = offset;
+		offset += pack_result(call, data + offset);
+	}
+
+	debug("amx_tick: batched callback: %s, %d results", calls[first].callback.c_str(), count);
+
+	amx_Push(amx, count);
+	amx_Push(amx, amx_addr + count * 2 * sizeof(cell));
+	amx_Push(amx, amx_addr + count * sizeof(cell));
+	amx_Push(amx, amx_addr);
+
+	record_heap(amx, heap_start);
+
+	amx_Exec(amx, &amx_ret, amx_idx);
+	amx_Release(amx, amx_addr);
+
+	Pawpy::callback_execs++;
+	Pawpy::callback_batched += count;
+
+	/*
+		Note:
+		Every result waited on its own but they share one callback span.
+	*/
+	if(Pawpy::tracing())
+	{
+		for(size_t i = first; i < last; ++i)
+			Pawpy::trace_async("result", calls[i].module, calls[i].function, calls[i].id, calls[i].timing.finished, start);
+
+		Pawpy::trace_span("callback", Pawpy::name_t(), calls[first].callback, 0, start, std::chrono::steady_clock::now());
+	}
+}
+
+/*
+	Note:
+	This is a ProcessTick function called for each AMX instance (see main.cpp)
+	The AMX's backlog is processed in the order the calls finished. For each
+	pycall the AMX code looks up the public callback function, pushes the
+	result stored in the pycall object from the end of run_call onto the
+	parameters and calls the function in Pawn, the circle is complete!
+
+	Results for batched callbacks are set aside instead and each batched
+	callback is called once at the end with everything it got this tick, so
+	hundreds of results cost one amx_Exec rather than hundreds.
+
+	This runs on the server's main thread so it must never wait for anything.
+	Once the deadline passes the remaining results are left in the backlog for
+	the next tick, at least one result is always delivered so the backlog
+	can't get stuck behind a slow callback.
+*/
+void Pawpy::amx_tick(AMX* amx, std::chrono::steady_clock::time_point deadline)
+{
+	auto found = amx_states.find(amx);
+
+	if(found == amx_states.end())
+		return;
+
+	amx_state_t& state = found->second;
+	ring_queue<pycall_t>& backlog = state.backlog;
+
+	if(backlog.empty())
+		return;
+
+	Pawpy::pycall_t call;
+	int amx_idx = -1;
+
+	while(!backlog.empty())
+	{
+		call = std::move(backlog.front());
+		backlog.pop_front();
+
+		if(call.batch_more ? !batch_item_wanted(call) : !call_deliver(call.id))
+		{
+			record_release(std::move(call));
+			continue;
+		}
+
+		/*
+			Note:
+			A typed callback can't be called without its values, the error
+			was already printed by the worker. A call that timed out is the
+			exception, its callback gets zeros and empty strings and can tell
+			what happened from GetPythonCallStatus.
+		*/
+		if(call.failed && !call.return_format.empty())
+		{
+			if(!call.timed_out)
+			{
+				forget_call(call);
+				record_release(std::move(call));
+				continue;
+			}
+
+			empty_results(call);
+		}
+
+		if(!state.batched.empty() && state.batched.find(call.callback) != state.batched.end())
+		{
+			state.pending[call.callback].push_back(std::move(call));
+		}
+		else
+		{
+			amx_idx = find_public(amx, state, call.callback);
+
+			if(amx_idx >= 0)
+				deliver_result(amx, amx_idx, call);
+
+			forget_call(call);
+			record_release(std::move(call));
+		}
+
+		if(!backlog.empty() && std::chrono::steady_clock::now() >= deadline)
+		{
+			debug("amx_tick: tick budget used, deferring %d results", backlog.size());
+			backlog_deferred += backlog.size();
+			backlog_deferred_ticks++;
+			break;
+		}
+	}
+
+	for(auto& pending : state.pending)
+	{
+		vector<pycall_t>& calls = pending.second;
+
+		if(calls.empty())
+			continue;
+
+		amx_idx = find_public(amx, state, pending.first);
+
+		if(amx_idx >= 0)
+			deliver_batch(amx, amx_idx, calls, 0, calls.size());
+
+		for(auto& c : calls)
+		{
+			forget_call(c);
+			record_release(std::move(c));
+		}
+
+		calls.clear();
+	}
+}
+
+size_t Pawpy::backlog_size()
+{
+	size_t size = 0;
+
+	for(auto& state : amx_states)
+		size += state.second.backlog.size();
+
+	return size;
 }
@@ -32,17 +32,17 @@
 
 #include <string>
 #include <vector>
-#include <stack>
 #include <thread>
-#include <mutex>
+#include <chrono>
 
 using std::string;
 using std::vector;
-using std::stack;
 using std::thread;
-using std::mutex;
 
 #include "main.hpp"
+#include "python_meta.hpp"
+#include "mpsc_queue.hpp"
+#include "names.hpp"
 #include <amx/amx.h>
 #include <amx/amx2.h>
 #include <plugincommon.h>
@@ -51,27 +51,138 @@ using std::mutex;
 namespace Pawpy
 {
 
+/*
+	Note:
+	Worker queue priorities, these must match the PyPriority enumerator in
+	pawpy.inc. Workers always take the most urgent call waiting.
+*/
+enum call_priority_t
+{
+	PRIORITY_HIGH,
+	PRIORITY_NORMAL,
+	PRIORITY_LOW,
+	PRIORITY_COUNT
+};
+
+/*
+	Note:
+	One argument from a Pawn native call. The cells are copied exactly as they
+	are in AMX memory on the main thread and are only turned into Python
+	objects on a worker while it holds the GIL, nothing is ever formatted into
+	a string and parsed again. The type is the format specifier character:
+	'd' (int), 'f' (float), 's' (string), 'a' (int array) or 'm' and 'M' (int
+	and float arrays passed as a memoryview). Ints and floats use value,
+	strings and arrays use cells.
+*/
+struct pyarg_t
+{
+	char type;
+	cell value;
+	vector<cell> cells;
+};
+
+/*
+	Note:
+	The time a call was submitted, taken off the queue by a worker, given the
+	GIL and finished running. The stages a call skips (a cached result is
+	never run) are left at zero.
+
+	entered (the native was called) and resolved (the function was found)
+	are only needed for tracing so they're only set while a trace is
+	running, see trace.cpp.
+*/
+struct pytiming_t
+{
+	std::chrono::steady_clock::time_point entered;
+	std::chrono::steady_clock::time_point submitted;
+	std::chrono::steady_clock::time_point dequeued;
+	std::chrono::steady_clock::time_point acquired;
+	std::chrono::steady_clock::time_point resolved;
+	std::chrono::steady_clock::time_point finished;
+};
+
+/*
+	Note:
+	module, function, callback and return_format are interned names, see
+	names.cpp. Records are recycled rather than destroyed, see records.cpp.
+
+	return_format is empty for the original string callbacks, where the result
+	ends up in returns. Otherwise each character is a specifier ('d', 'f', 's',
+	'a', 'v', 'm' or 'M') and the converted values end up in results.
+
+	A batch job has one argument list per item in batch and runs the function
+	once for each of them. With batch_single the results are gathered into a
+	single callback, otherwise every item gets its own callback as usual.
+	Those items share the batch's call ID and batch_more is set on all of them
+	but the last, the call's state is only forgotten once the last one is
+	delivered.
+
+	cache_key identifies calls to functions that are cached or coalesced, see
+	cache.cpp. coalesced is set on a call that other identical calls may be
+	waiting on.
+
+	amx is the script that made the call, its callback is only ever looked up
+	and called in that script. id is the call ID returned to Pawn (see
+	callstate.cpp) and priority picks the worker queue it waits in. timeout is
+	the call's timeout once a worker has started it and timed_out is set if
+	it ran past it, see watchdog.cpp.
+
+	timing is when the call reached each stage, see metrics.cpp.
+*/
 struct pycall_t
 {
-	string module;
-	string function;
-	string callback;
-	vector<string> arguments;
+	name_t module;
+	name_t function;
+	name_t callback;
+	name_t return_format;
+	vector<pyarg_t> arguments;
 	std::thread::id threadid;
 	string returns;
+	vector<pyarg_t> results;
+	bool failed;
+	vector<vector<pyarg_t>> batch;
+	bool batch_single;
+	bool batch_more;
+	string cache_key;
+	bool coalesced;
+	AMX* amx;
+	cell id;
+	int priority;
+	unsigned int timeout;
+	bool timed_out;
+	pytiming_t timing;
 };
 
-extern stack<Pawpy::pycall_t> call_stack;
-extern mutex call_stack_mutex;
-
-pycall_t prepare(string module, string function, string callback, vector<string> arguments);
+extern mpsc_queue<Pawpy::pycall_t> call_queue;
+extern PyThreadState* main_thread_state;
 
-int run_python_threaded(pycall_t call);
-void python_thread(pycall_t pycall);
+extern unsigned int backlog_deferred;
+extern unsigned int backlog_deferred_ticks;
+extern unsigned int callback_execs;
+extern unsigned int callback_batched;
+extern unsigned int callback_heap_peak;
+extern unsigned int tick_time;
+extern unsigned int tick_time_peak;
 
-string run_python(pycall_t pycall);
+pycall_t prepare(name_t module, name_t function, name_t callback, name_t return_format);
+PyObject* build_argument(const pyarg_t& arg);
 
-void amx_tick(AMX* amx);
+cell run_python_threaded(pycall_t call);
+cell submit_threaded(pycall_t&& call);
+void python_thread(pycall_t pycall);
+void python_batch(pycall_t pycall);
+
+bool call_python(pycall_t& pycall);
+PyObject* invoke_python(pycall_t& pycall);
+bool finish_python(PyObject* result_ptr, pycall_t& pycall);
+bool run_python_main(pycall_t& pycall);
+
+void amx_load(AMX* amx);
+void amx_unload(AMX* amx);
+void amx_set_batched(AMX* amx, const string& callback, bool batched);
+void collect_results();
+void amx_tick(AMX* amx, std::chrono::steady_clock::time_point deadline);
+size_t backlog_size();
 
 }
 
@@ -0,0 +1,366 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Originally every RunPythonThreaded call created and detached its own
+		thread, which meant creating an OS thread and a fresh Python thread
+		state per call and an unbounded number of threads during bursts. Now a
+		fixed set of workers is created once and each one keeps its Python
+		thread state for its entire life.
+
+
+==============================================================================*/
+
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using std::vector;
+using std::thread;
+using std::mutex;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "pool.hpp"
+#include "callables.hpp"
+#include "settings.hpp"
+#include "ring.hpp"
+#include "records.hpp"
+
+
+/*
+	Note:
+	Pool size and queue capacity, set once in pool_start. The queued counters
+	are updated by the native and the workers so they're atomic, they exist so
+	the pool can be sized from the numbers a real server produces.
+*/
+unsigned int Pawpy::pool_workers = 0;
+unsigned int Pawpy::pool_queue_depth = 0;
+std::atomic<unsigned int> Pawpy::pool_queued(0);
+std::atomic<unsigned int> Pawpy::pool_queued_peak(0);
+std::atomic<unsigned int> Pawpy::pool_rejected(0);
+std::atomic<unsigned int> Pawpy::pool_isolated(0);
+
+/*
+	Note:
+	Each worker's Python thread state while it doesn't hold the GIL. For
+	workers with their own subinterpreter this is the thread state in that
+	interpreter.
+*/
+thread_local PyThreadState* Pawpy::worker_thread_state = nullptr;
+
+/*
+	Note:
+	The job queue is a plain FIFO per priority protected by a mutex, workers
+	take from the highest priority queue that isn't empty and sleep on the
+	condition variable until there's something in one or the pool is
+	stopping. pool_queued is the total across all of them. Each queue is
+	sized for the whole queue depth when the pool starts so submitting never
+	allocates.
+*/
+static Pawpy::ring_queue<Pawpy::pycall_t> job_queues[Pawpy::PRIORITY_COUNT];
+static mutex job_queue_mutex;
+static std::condition_variable job_queue_cv;
+static bool pool_running = false;
+static vector<thread> worker_threads;
+
+
+/*
+	Note:
+	The main interpreter, taken in pool_start. Every worker creates its own
+	thread state in it.
+*/
+static PyInterpreterState* main_interpreter = nullptr;
+
+/*
+	Note:
+	The thread states a worker owns. main is always a thread state in the
+	main interpreter, sub is only set when the worker is running its own
+	subinterpreter.
+*/
+struct worker_state_t
+{
+	PyThreadState* main;
+	PyThreadState* sub;
+};
+
+/*
+	Note:
+	Since Python 3.12 (PEP 684) a subinterpreter can have its own GIL, so
+	workers that each own one can run Python code in parallel instead of all
+	taking turns on the main interpreter's GIL. Modules are imported
+	separately in each one and C extensions that don't support being loaded
+	into multiple interpreters will fail to import. Returns false if the
+	subinterpreter couldn't be created, the worker then stays on the main
+	interpreter.
+*/
+static bool start_subinterpreter(worker_state_t& state)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	PyInterpreterConfig config;
+	config.use_main_obmalloc = 0;
+	config.allow_fork = 0;
+	config.allow_exec = 0;
+	config.allow_threads = 1;
+	config.allow_daemon_threads = 0;
+	config.check_multi_interp_extensions = 1;
+	config.gil = PyInterpreterConfig_OWN_GIL;
+
+	PyThreadState* substate = nullptr;
+	PyStatus status = Py_NewInterpreterFromConfig(&substate, &config);
+
+	if(PyStatus_Exception(status))
+	{
+		samp_printf("ERROR: Failed to create subinterpreter: %s", status.err_msg ? status.err_msg : "unknown error");
+		return false;
+	}
+
+	/*
+		Note:
+		The new interpreter's GIL is now held and the main one was released.
+		sys.path is per-interpreter so it has to be set up again.
+	*/
+	Pawpy::setup_sys_path();
+	Pawpy::begin_local_callables();
+
+	state.sub = substate;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+	Note:
+	Creates the worker's thread state (and subinterpreter, if enabled) once,
+	then releases the GIL. The state is kept in worker_thread_state so
+	python_thread can take the GIL back with it for every call instead of
+	building a new thread state each time.
+*/
+static worker_state_t worker_start()
+{
+	worker_state_t state;
+
+	state.main = PyThreadState_New(main_interpreter);
+	state.sub = nullptr;
+
+	PyEval_RestoreThread(state.main);
+
+	if(Pawpy::settings.subinterpreters && start_subinterpreter(state))
+		Pawpy::pool_isolated++;
+
+	Pawpy::worker_thread_state = PyEval_SaveThread();
+
+	return state;
+}
+
+static void worker_stop(worker_state_t& state)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	if(state.sub != nullptr)
+	{
+		PyEval_RestoreThread(Pawpy::worker_thread_state);
+		Pawpy::end_local_callables();
+		Py_EndInterpreter(state.sub);
+	}
+#endif
+
+	PyEval_RestoreThread(state.main);
+	PyThreadState_Clear(state.main);
+	PyThreadState_DeleteCurrent();
+}
+
+/*
+	Note:
+	The body of each worker thread.
+*/
+static void pool_worker()
+{
+	worker_state_t state = worker_start();
+
+	Pawpy::pycall_t call;
+
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(job_queue_mutex);
+
+			job_queue_cv.wait(lock, [] { return !pool_running || Pawpy::pool_queued > 0; });
+
+			if(!pool_running)
+				break;
+
+			for(auto& job_queue : job_queues)
+			{
+				if(job_queue.empty())
+					continue;
+
+				call = std::move(job_queue.front());
+				job_queue.pop_front();
+				break;
+			}
+
+			Pawpy::pool_queued--;
+		}
+
+		Pawpy::python_thread(std::move(call));
+	}
+
+	worker_stop(state);
+}
+
+/*
+	Note:
+	Starts the workers, called once from Load after the interpreter is ready.
+*/
+void Pawpy::pool_start(unsigned int workers, unsigned int queue_depth)
+{
+	pool_workers = workers;
+	pool_queue_depth = queue_depth;
+	pool_running = true;
+
+	/*
+		Note:
+		Only the main interpreter exists at this point so the head of the
+		interpreter list is the main one.
+	*/
+	main_interpreter = PyInterpreterState_Head();
+
+#if PY_VERSION_HEX < 0x030C0000
+	if(settings.subinterpreters)
+		samp_printf("Pawpy: subinterpreters need Python 3.12 or newer, workers will share the GIL.");
+#endif
+
+	for(auto& job_queue : job_queues)
+		job_queue.reserve(queue_depth);
+
+	worker_threads.reserve(workers);
+
+	for(unsigned int i = 0; i < workers; ++i)
+	{
+		worker_threads.push_back(thread(pool_worker));
+	}
+}
+
+/*
+	Note:
+	Stops and joins all the workers, any calls still waiting in the queue are
+	thrown away since the server is shutting down. Must be called before the
+	interpreter is finalised and while the calling thread doesn't hold the GIL
+	or the workers will never be able to release their thread states.
+*/
+void Pawpy::pool_stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(job_queue_mutex);
+		pool_running = false;
+
+		for(auto& job_queue : job_queues)
+			job_queue.clear();
+
+		pool_queued = 0;
+	}
+
+	job_queue_cv.notify_all();
+
+	for(auto& t : worker_threads)
+	{
+		t.join();
+	}
+
+	worker_threads.clear();
+}
+
+/*
+	Note:
+	Hands a call to the pool. This is called from the main thread so it must
+	never block, when the queue is already full the call is rejected and the
+	caller gets false with the call left as it was.
+*/
+bool Pawpy::pool_submit(pycall_t&& call)
+{
+	{
+		std::lock_guard<std::mutex> lock(job_queue_mutex);
+
+		if(pool_queued >= pool_queue_depth)
+		{
+			pool_rejected++;
+			return false;
+		}
+
+		job_queues[call.priority].push_back(std::move(call));
+
+		unsigned int queued = ++pool_queued;
+
+		if(queued > pool_queued_peak)
+			pool_queued_peak = queued;
+	}
+
+	job_queue_cv.notify_one();
+
+	return true;
+}
+
+/*
+	Note:
+	Removes a call from the queue if it hasn't been picked up by a worker yet.
+	A call other identical calls are waiting on (see cache.cpp) is left alone,
+	it still has to run for them. Only called by natives, so the removed
+	call's record goes straight back on the free list once the queue is
+	unlocked.
+*/
+bool Pawpy::pool_cancel(cell id)
+{
+	pycall_t cancelled;
+
+	{
+		std::lock_guard<std::mutex> lock(job_queue_mutex);
+		bool found = false;
+
+		for(auto& job_queue : job_queues)
+		{
+			for(size_t i = 0; i < job_queue.size() && !found; ++i)
+			{
+				if(job_queue[i].id != id)
+					continue;
+
+				if(job_queue[i].coalesced)
+					return false;
+
+				cancelled = std::move(job_queue[i]);
+				job_queue.erase(i);
+				pool_queued--;
+				found = true;
+			}
+		}
+
+		if(!found)
+			return false;
+	}
+
+	record_release(std::move(cancelled));
+
+	return true;
+}
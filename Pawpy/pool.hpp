@@ -0,0 +1,58 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The worker pool. A fixed number of threads are started when the plugin
+		loads and they live until it unloads, picking Python calls off a bounded
+		job queue. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_POOL_H
+#define PAWPY_POOL_H
+
+#include <atomic>
+
+#include "main.hpp"
+#include "python_meta.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+extern unsigned int pool_workers;
+extern unsigned int pool_queue_depth;
+extern std::atomic<unsigned int> pool_queued;
+extern std::atomic<unsigned int> pool_queued_peak;
+extern std::atomic<unsigned int> pool_rejected;
+extern std::atomic<unsigned int> pool_isolated;
+extern thread_local PyThreadState* worker_thread_state;
+
+void pool_start(unsigned int workers, unsigned int queue_depth);
+void pool_stop();
+bool pool_submit(pycall_t&& call);
+bool pool_cancel(cell id);
+
+}
+
+#endif
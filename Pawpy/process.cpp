@@ -0,0 +1,823 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Worker processes give real multi-core parallelism without relying on
+		subinterpreter support in C extensions, and a crashing extension only
+		takes down its worker instead of the whole SA:MP server. Linux only.
+
+		The layout is:
+
+		- server: the SA:MP server process. It writes requests into each
+		  worker's request ring and reads results back out of its result ring
+		  from ProcessTick.
+		- zygote: forked in Load before Python is initialised or any thread
+		  is started. It's a single-threaded copy of the server that does
+		  nothing but fork workers and restart them when they die, because
+		  forking the server itself later on (with threads and a live
+		  interpreter) is not safe.
+		- workers: forked from the zygote, each initialises its own Python
+		  interpreter and runs calls from its request ring one at a time.
+
+		The rings live in an anonymous shared mapping created before the
+		zygote is forked so all three share it. Each ring has exactly one
+		producer and one consumer so it only needs a pair of atomic counters.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstring>
+
+using std::string;
+using std::vector;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "process.hpp"
+#include "callables.hpp"
+#include "ring.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#endif
+
+
+#ifdef __linux__
+
+/*
+	Note:
+	Size of each ring in bytes, must be a power of two. A single message can't
+	be larger than half of this.
+*/
+#define PROCESS_RING_SIZE (1 << 20)
+
+/*
+	Note:
+	head and tail only ever increase (and wrap at 2^32), the difference is
+	the number of bytes in use. Messages are a 32 bit length followed by the
+	payload and may wrap around the end of data.
+*/
+struct ring_t
+{
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+	char data[PROCESS_RING_SIZE];
+};
+
+/*
+	Note:
+	generation is incremented by the zygote every time it starts a worker in
+	this slot, so the server can tell a worker was restarted. Before that the
+	zygote stores the request ring's tail in lost_tail: every request before
+	it was taken by a worker that is now dead, so any of those that haven't
+	got a result by then never will. Requests after it are still in the ring
+	and the new worker carries on with them.
+*/
+struct slot_t
+{
+	ring_t requests;
+	ring_t results;
+	sem_t requests_ready;
+	std::atomic<uint32_t> generation;
+	std::atomic<uint32_t> lost_tail;
+};
+
+struct shared_t
+{
+	std::atomic<uint32_t> running;
+	std::atomic<uint32_t> restarts;
+	slot_t slots[1];
+};
+
+/*
+	Note:
+	A call that has been sent to a worker and is waiting for its result. end
+	is the request ring's head just after the request, compared against
+	lost_tail when a worker dies. Only touched by the server's main thread.
+*/
+struct pending_t
+{
+	uint32_t seq;
+	uint32_t end;
+	Pawpy::pycall_t call;
+};
+
+/*
+	Note:
+	What a request message asks the worker to do. A reload carries just the
+	module name and gets no result.
+*/
+enum request_kind
+{
+	REQUEST_CALL,
+	REQUEST_RELOAD
+};
+
+static shared_t* shared = nullptr;
+static size_t shared_size = 0;
+static unsigned int slot_count = 0;
+static pid_t zygote_pid = -1;
+
+static vector<Pawpy::ring_queue<pending_t>> pending;
+static vector<uint32_t> known_generation;
+static uint32_t next_seq = 0;
+
+
+/*==============================================================================
+
+	Ring buffers
+
+==============================================================================*/
+
+
+static void ring_write(ring_t& ring, uint32_t position, const void* source, uint32_t length)
+{
+	uint32_t offset = position & (PROCESS_RING_SIZE - 1);
+	uint32_t first = PROCESS_RING_SIZE - offset;
+
+	if(first > length)
+		first = length;
+
+	memcpy(ring.data + offset, source, first);
+	memcpy(ring.data, static_cast<const char*>(source) + first, length - first);
+}
+
+static void ring_read(ring_t& ring, uint32_t position, void* dest, uint32_t length)
+{
+	uint32_t offset = position & (PROCESS_RING_SIZE - 1);
+	uint32_t first = PROCESS_RING_SIZE - offset;
+
+	if(first > length)
+		first = length;
+
+	memcpy(dest, ring.data + offset, first);
+	memcpy(static_cast<char*>(dest) + first, ring.data, length - first);
+}
+
+/*
+	Note:
+	Producer side. Returns false if there isn't room for the message.
+*/
+static bool ring_push(ring_t& ring, const vector<char>& message)
+{
+	uint32_t head = ring.head.load(std::memory_order_relaxed);
+	uint32_t tail = ring.tail.load(std::memory_order_acquire);
+	uint32_t length = message.size();
+
+	if(PROCESS_RING_SIZE - (head - tail) < sizeof(length) + length)
+		return false;
+
+	ring_write(ring, head, &length, sizeof(length));
+	ring_write(ring, head + sizeof(length), message.data(), length);
+
+	ring.head.store(head + sizeof(length) + length, std::memory_order_release);
+
+	return true;
+}
+
+/*
+	Note:
+	Consumer side. Returns false if the ring is empty.
+*/
+static bool ring_pop(ring_t& ring, vector<char>& message)
+{
+	uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+	uint32_t head = ring.head.load(std::memory_order_acquire);
+	uint32_t length;
+
+	if(head == tail)
+		return false;
+
+	ring_read(ring, tail, &length, sizeof(length));
+	message.resize(length);
+	ring_read(ring, tail + sizeof(length), message.data(), length);
+
+	ring.tail.store(tail + sizeof(length) + length, std::memory_order_release);
+
+	return true;
+}
+
+
+/*==============================================================================
+
+	Message encoding
+
+	Note:
+	Requests carry everything a worker needs to make the call and results
+	carry everything call_python fills in. Both are plain native-endian binary
+	since both ends are always the same build of the plugin.
+
+==============================================================================*/
+
+
+static void put_u32(vector<char>& out, uint32_t value)
+{
+	out.insert(out.end(), reinterpret_cast<char*>(&value), reinterpret_cast<char*>(&value) + sizeof(value));
+}
+
+static void put_string(vector<char>& out, const string& value)
+{
+	put_u32(out, value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+static void put_args(vector<char>& out, const vector<Pawpy::pyarg_t>& args)
+{
+	put_u32(out, args.size());
+
+	for(auto& arg : args)
+	{
+		out.push_back(arg.type);
+		put_u32(out, arg.value);
+		put_u32(out, arg.cells.size());
+		out.insert(out.end(), reinterpret_cast<const char*>(arg.cells.data()), reinterpret_cast<const char*>(arg.cells.data() + arg.cells.size()));
+	}
+}
+
+struct reader_t
+{
+	const char* position;
+	const char* end;
+};
+
+static bool get_u32(reader_t& in, uint32_t& value)
+{
+	if(in.end - in.position < static_cast<ptrdiff_t>(sizeof(value)))
+		return false;
+
+	memcpy(&value, in.position, sizeof(value));
+	in.position += sizeof(value);
+
+	return true;
+}
+
+static bool get_string(reader_t& in, string& value)
+{
+	uint32_t length;
+
+	if(!get_u32(in, length) || in.end - in.position < static_cast<ptrdiff_t>(length))
+		return false;
+
+	value.assign(in.position, length);
+	in.position += length;
+
+	return true;
+}
+
+static bool get_name(reader_t& in, Pawpy::name_t& value)
+{
+	string name;
+
+	if(!get_string(in, name))
+		return false;
+
+	value = name;
+
+	return true;
+}
+
+static bool get_args(reader_t& in, vector<Pawpy::pyarg_t>& args)
+{
+	uint32_t count;
+	uint32_t value;
+	uint32_t cells;
+
+	if(!get_u32(in, count))
+		return false;
+
+	args.resize(count);
+
+	for(auto& arg : args)
+	{
+		if(in.position == in.end)
+			return false;
+
+		arg.type = *in.position++;
+
+		if(!get_u32(in, value) || !get_u32(in, cells))
+			return false;
+
+		if(in.end - in.position < static_cast<ptrdiff_t>(cells * sizeof(cell)))
+			return false;
+
+		arg.value = value;
+		arg.cells.resize(cells);
+		memcpy(arg.cells.data(), in.position, cells * sizeof(cell));
+		in.position += cells * sizeof(cell);
+	}
+
+	return true;
+}
+
+static void encode_request(vector<char>& out, uint32_t seq, const Pawpy::pycall_t& call)
+{
+	out.clear();
+	put_u32(out, REQUEST_CALL);
+	put_u32(out, seq);
+	put_string(out, call.module);
+	put_string(out, call.function);
+	put_string(out, call.return_format);
+	put_args(out, call.arguments);
+}
+
+static void encode_reload(vector<char>& out, const string& module)
+{
+	out.clear();
+	put_u32(out, REQUEST_RELOAD);
+	put_string(out, module);
+}
+
+static bool decode_request(const vector<char>& in, uint32_t& kind, uint32_t& seq, Pawpy::pycall_t& call)
+{
+	reader_t reader = {in.data(), in.data() + in.size()};
+
+	if(!get_u32(reader, kind))
+		return false;
+
+	if(kind == REQUEST_RELOAD)
+		return get_name(reader, call.module);
+
+	return kind == REQUEST_CALL
+		&& get_u32(reader, seq)
+		&& get_name(reader, call.module)
+		&& get_name(reader, call.function)
+		&& get_name(reader, call.return_format)
+		&& get_args(reader, call.arguments);
+}
+
+static void encode_result(vector<char>& out, uint32_t seq, const Pawpy::pycall_t& call)
+{
+	out.clear();
+	put_u32(out, seq);
+	put_u32(out, call.failed);
+	put_string(out, call.returns);
+	put_args(out, call.results);
+}
+
+static bool decode_result(const vector<char>& in, uint32_t& seq, Pawpy::pycall_t& call)
+{
+	reader_t reader = {in.data(), in.data() + in.size()};
+	uint32_t failed;
+
+	if(!get_u32(reader, seq) || !get_u32(reader, failed))
+		return false;
+
+	call.failed = failed != 0;
+
+	return get_string(reader, call.returns) && get_args(reader, call.results);
+}
+
+
+/*==============================================================================
+
+	Worker and zygote processes
+
+==============================================================================*/
+
+
+/*
+	Note:
+	The body of a worker process. It has its own interpreter and it's the only
+	thread in the process so it simply holds the GIL the whole time. Results
+	that don't fit in the result ring wait for the server to drain it, which
+	it does every tick. The ring is checked before waiting so a restarted
+	worker picks up requests its predecessor was woken for but never took.
+*/
+static void worker_process(slot_t& slot)
+{
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	Py_Initialize();
+	Pawpy::setup_sys_path();
+
+	vector<char> message;
+	Pawpy::pycall_t call;
+	uint32_t kind;
+	uint32_t seq;
+
+	while(shared->running)
+	{
+		while(shared->running && ring_pop(slot.requests, message))
+		{
+			call = Pawpy::pycall_t();
+
+			if(!decode_request(message, kind, seq, call))
+			{
+				samp_printf("ERROR: Pawpy worker process received a malformed request.");
+				continue;
+			}
+
+			if(kind == REQUEST_RELOAD)
+			{
+				Pawpy::request_reload(call.module);
+				continue;
+			}
+
+			call.failed = !Pawpy::call_python(call);
+
+			encode_result(message, seq, call);
+
+			if(message.size() > PROCESS_RING_SIZE / 2)
+			{
+				samp_printf("ERROR: Result of '%s.%s' is too large for the result ring.", call.module.c_str(), call.function.c_str());
+				call.failed = true;
+				call.returns.clear();
+				call.results.clear();
+				encode_result(message, seq, call);
+			}
+
+			while(shared->running && !ring_push(slot.results, message))
+				usleep(1000);
+		}
+
+		sem_wait(&slot.requests_ready);
+	}
+
+	Pawpy::clear_callables();
+	Py_Finalize();
+	_exit(0);
+}
+
+static pid_t spawn_worker(unsigned int index)
+{
+	slot_t& slot = shared->slots[index];
+
+	slot.generation++;
+
+	pid_t pid = fork();
+
+	if(pid == 0)
+		worker_process(slot);
+
+	return pid;
+}
+
+/*
+	Note:
+	The zygote waits on its workers and replaces any that exit while the
+	plugin is still running. The dead worker's request ring is left as it
+	is for the new worker, only lost_tail is recorded (before the generation
+	changes) so the server can fail the calls the dead worker had taken.
+	Once running is cleared it just waits for the workers to finish and
+	exits.
+*/
+static void zygote_process()
+{
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	vector<pid_t> workers(slot_count, -1);
+
+	for(unsigned int i = 0; i < slot_count; ++i)
+		workers[i] = spawn_worker(i);
+
+	int status;
+	pid_t pid;
+
+	for(;;)
+	{
+		pid = waitpid(-1, &status, 0);
+
+		if(pid < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if(!shared->running)
+			continue;
+
+		for(unsigned int i = 0; i < slot_count; ++i)
+		{
+			if(workers[i] != pid)
+				continue;
+
+			slot_t& slot = shared->slots[i];
+
+			slot.lost_tail.store(slot.requests.tail.load());
+			shared->restarts++;
+
+			/*
+				Note:
+				Don't spin if a worker dies straight away every time, for
+				example a module that crashes the interpreter on import.
+			*/
+			usleep(100000);
+
+			workers[i] = spawn_worker(i);
+			break;
+		}
+	}
+
+	_exit(0);
+}
+
+#endif
+
+
+/*==============================================================================
+
+	Server side
+
+==============================================================================*/
+
+
+/*
+	Note:
+	Creates the shared memory and forks the zygote. Must be called from Load
+	before Python is initialised and before any threads are started.
+*/
+bool Pawpy::process_start(unsigned int count)
+{
+#ifdef __linux__
+	if(count == 0)
+		return false;
+
+	shared_size = sizeof(shared_t) + sizeof(slot_t) * (count - 1);
+
+	void* memory = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if(memory == MAP_FAILED)
+	{
+		samp_printf("ERROR: Failed to map %d bytes of shared memory for worker processes.", shared_size);
+		return false;
+	}
+
+	shared = static_cast<shared_t*>(memory);
+	shared->running = 1;
+	shared->restarts = 0;
+
+	for(unsigned int i = 0; i < count; ++i)
+	{
+		slot_t& slot = shared->slots[i];
+
+		slot.requests.head = 0;
+		slot.requests.tail = 0;
+		slot.results.head = 0;
+		slot.results.tail = 0;
+		slot.generation = 0;
+		slot.lost_tail = 0;
+		sem_init(&slot.requests_ready, 1, 0);
+	}
+
+	slot_count = count;
+	pending.resize(count);
+	known_generation.assign(count, 1);
+
+	zygote_pid = fork();
+
+	if(zygote_pid == 0)
+		zygote_process();
+
+	if(zygote_pid < 0)
+	{
+		samp_printf("ERROR: Failed to fork the Pawpy worker process zygote.");
+		munmap(shared, shared_size);
+		shared = nullptr;
+		slot_count = 0;
+		return false;
+	}
+
+	return true;
+#else
+	if(count > 0)
+		samp_printf("Pawpy: worker processes are only supported on Linux, using worker threads.");
+
+	return false;
+#endif
+}
+
+/*
+	Note:
+	Tells the workers to finish and waits a couple of seconds for them. If a
+	worker is stuck in a call, the zygote is killed which takes the workers
+	with it.
+*/
+void Pawpy::process_stop()
+{
+#ifdef __linux__
+	if(shared == nullptr)
+		return;
+
+	shared->running = 0;
+
+	for(unsigned int i = 0; i < slot_count; ++i)
+		sem_post(&shared->slots[i].requests_ready);
+
+	int status;
+
+	for(int i = 0; i < 200; ++i)
+	{
+		if(waitpid(zygote_pid, &status, WNOHANG) != 0)
+			break;
+
+		usleep(10000);
+	}
+
+	if(waitpid(zygote_pid, &status, WNOHANG) == 0)
+	{
+		kill(zygote_pid, SIGKILL);
+		waitpid(zygote_pid, &status, 0);
+	}
+
+	munmap(shared, shared_size);
+	shared = nullptr;
+	slot_count = 0;
+#endif
+}
+
+bool Pawpy::process_enabled()
+{
+#ifdef __linux__
+	return shared != nullptr;
+#else
+	return false;
+#endif
+}
+
+/*
+	Note:
+	Sends a call to the worker with the fewest calls outstanding. Like the
+	thread pool this fails rather than blocks when the worker's request ring
+	is full.
+*/
+bool Pawpy::process_submit(pycall_t&& call)
+{
+#ifdef __linux__
+	unsigned int index = 0;
+
+	for(unsigned int i = 1; i < slot_count; ++i)
+	{
+		if(pending[i].size() < pending[index].size())
+			index = i;
+	}
+
+	slot_t& slot = shared->slots[index];
+	static vector<char> message;
+	uint32_t seq = next_seq++;
+
+	encode_request(message, seq, call);
+
+	if(message.size() > PROCESS_RING_SIZE / 2 || !ring_push(slot.requests, message))
+		return false;
+
+	sem_post(&slot.requests_ready);
+
+	pending_t entry;
+	entry.seq = seq;
+	entry.end = slot.requests.head.load(std::memory_order_relaxed);
+	entry.call = std::move(call);
+
+	pending[index].push_back(std::move(entry));
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+	Note:
+	Asks every worker to reload a module (or everything, for an empty name),
+	the same way ReloadPythonModule does for the worker threads. The request
+	goes through the ring with the calls so calls sent after it see the
+	reloaded module.
+*/
+void Pawpy::process_reload(const string& module)
+{
+#ifdef __linux__
+	static vector<char> message;
+
+	encode_reload(message, module);
+
+	for(unsigned int i = 0; i < slot_count; ++i)
+	{
+		slot_t& slot = shared->slots[i];
+
+		if(!ring_push(slot.requests, message))
+		{
+			samp_printf("ERROR: Couldn't send the reload of '%s' to Pawpy worker process %d, its request ring is full.", module.c_str(), i);
+			continue;
+		}
+
+		sem_post(&slot.requests_ready);
+	}
+#endif
+}
+
+/*
+	Note:
+	Called from ProcessTick. Moves every finished call into out, in the order
+	each worker finished them. Results arrive in the same order requests were
+	sent so any pending call older than a result was lost in a crash. When a
+	worker has been restarted, the calls its predecessor took from the ring
+	without answering are failed too. generation and lost_tail are read
+	before the results are drained: the zygote only writes them once a worker
+	is dead, so every result that worker sent is drained in the same pass.
+	Failed calls are still delivered so string callbacks fire with an empty
+	result, the same as a call that raised an exception.
+*/
+void Pawpy::process_drain(ring_queue<pycall_t>& out)
+{
+#ifdef __linux__
+	static vector<char> message;
+	static pycall_t result;
+	uint32_t seq;
+
+	for(unsigned int i = 0; i < slot_count; ++i)
+	{
+		slot_t& slot = shared->slots[i];
+		ring_queue<pending_t>& queue = pending[i];
+		uint32_t generation = slot.generation.load();
+		uint32_t lost_tail = slot.lost_tail.load();
+		unsigned int lost = 0;
+
+		while(ring_pop(slot.results, message))
+		{
+			if(!decode_result(message, seq, result))
+			{
+				samp_printf("ERROR: Malformed result from Pawpy worker process %d.", i);
+				continue;
+			}
+
+			while(!queue.empty() && static_cast<int32_t>(queue.front().seq - seq) < 0)
+			{
+				queue.front().call.failed = true;
+				out.push_back(std::move(queue.front().call));
+				queue.pop_front();
+			}
+
+			if(queue.empty() || queue.front().seq != seq)
+				continue;
+
+			pycall_t& call = queue.front().call;
+
+			call.failed = result.failed;
+			call.returns = std::move(result.returns);
+			call.results = std::move(result.results);
+
+			out.push_back(std::move(call));
+			queue.pop_front();
+		}
+
+		if(generation == known_generation[i])
+			continue;
+
+		while(!queue.empty() && static_cast<int32_t>(queue.front().end - lost_tail) <= 0)
+		{
+			queue.front().call.failed = true;
+			out.push_back(std::move(queue.front().call));
+			queue.pop_front();
+			lost++;
+		}
+
+		samp_printf("ERROR: Pawpy worker process %d died and was restarted, %d calls lost.", i, lost);
+
+		known_generation[i] = generation;
+	}
+#endif
+}
+
+unsigned int Pawpy::process_count()
+{
+	return slot_count;
+}
+
+unsigned int Pawpy::process_restarts()
+{
+#ifdef __linux__
+	if(shared != nullptr)
+		return shared->restarts;
+#endif
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Out-of-process workers. Instead of running on the worker pool, threaded
+		calls can be sent to a set of forked Python processes through shared
+		memory ring buffers. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_PROCESS_H
+#define PAWPY_PROCESS_H
+
+#include "main.hpp"
+#include "pawpy.hpp"
+#include "ring.hpp"
+
+
+namespace Pawpy
+{
+
+bool process_start(unsigned int count);
+void process_stop();
+bool process_enabled();
+bool process_submit(pycall_t&& call);
+void process_reload(const string& module);
+void process_drain(ring_queue<pycall_t>& out);
+
+unsigned int process_count();
+unsigned int process_restarts();
+
+}
+
+#endif
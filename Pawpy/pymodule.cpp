@@ -0,0 +1,168 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		A built-in module registered before the interpreter starts, so any
+		Python code run by the plugin can "import pawpy". It uses multi-phase
+		initialisation so it can also be imported in the workers' own
+		subinterpreters, there's no per-module state, everything it exposes
+		belongs to the plugin.
+
+		pawpy.stats() returns the same numbers as GetPythonStats and
+		GetPythonStat as a dict:
+
+			{
+				"queue_depth": 3,
+				"inflight": 12,
+				"functions": {
+					"geo.locate": {
+						"calls": 100, "errors": 1, "timeouts": 0,
+						"queue": {"p50": 40, "p95": 300, "p99": 900},
+						"gil": {...}, "execution": {...}, "delivery": {...}
+					}
+				}
+			}
+
+		Latencies are in microseconds.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <map>
+
+using std::string;
+using std::map;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "pymodule.hpp"
+#include "metrics.hpp"
+#include "callstate.hpp"
+#include "pool.hpp"
+
+
+static const char* metric_names[Pawpy::METRIC_COUNT] = {"queue", "gil", "execution", "delivery"};
+
+
+static PyObject* function_dict(const Pawpy::function_stats_t& stats)
+{
+	PyObject* dict = Py_BuildValue("{s:K,s:K,s:K}",
+		"calls", static_cast<unsigned long long>(stats.calls),
+		"errors", static_cast<unsigned long long>(stats.errors),
+		"timeouts", static_cast<unsigned long long>(stats.timeouts));
+
+	if(dict == nullptr)
+		return nullptr;
+
+	for(int i = 0; i < Pawpy::METRIC_COUNT; ++i)
+	{
+		PyObject* latency = Py_BuildValue("{s:I,s:I,s:I}",
+			"p50", stats.latency[i][0],
+			"p95", stats.latency[i][1],
+			"p99", stats.latency[i][2]);
+
+		if(latency == nullptr || PyDict_SetItemString(dict, metric_names[i], latency) != 0)
+		{
+			Py_XDECREF(latency);
+			Py_DECREF(dict);
+			return nullptr;
+		}
+
+		Py_DECREF(latency);
+	}
+
+	return dict;
+}
+
+static PyObject* pawpy_stats(PyObject* self, PyObject* unused)
+{
+	map<string, Pawpy::function_stats_t> stats;
+
+	Pawpy::metrics_all(stats);
+
+	PyObject* functions = PyDict_New();
+
+	if(functions == nullptr)
+		return nullptr;
+
+	for(auto& function : stats)
+	{
+		PyObject* entry = function_dict(function.second);
+
+		if(entry == nullptr || PyDict_SetItemString(functions, function.first.c_str(), entry) != 0)
+		{
+			Py_XDECREF(entry);
+			Py_DECREF(functions);
+			return nullptr;
+		}
+
+		Py_DECREF(entry);
+	}
+
+	return Py_BuildValue("{s:I,s:n,s:N}",
+		"queue_depth", static_cast<unsigned int>(Pawpy::pool_queued),
+		"inflight", static_cast<Py_ssize_t>(Pawpy::call_count()),
+		"functions", functions);
+}
+
+static PyMethodDef pawpy_methods[] =
+{
+	{"stats", pawpy_stats, METH_NOARGS, "Call counts and latency percentiles (in microseconds) for every function the plugin has called."},
+	{nullptr, nullptr, 0, nullptr}
+};
+
+static PyModuleDef_Slot pawpy_slots[] =
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+	{0, nullptr}
+};
+
+static PyModuleDef pawpy_module =
+{
+	PyModuleDef_HEAD_INIT,
+	"pawpy",
+	"Access to the Pawpy plugin from Python code.",
+	0,
+	pawpy_methods,
+	pawpy_slots,
+	nullptr,
+	nullptr,
+	nullptr
+};
+
+static PyObject* init_pawpy()
+{
+	return PyModuleDef_Init(&pawpy_module);
+}
+
+/*
+	Note:
+	Must be called before Py_Initialize, and before the worker processes are
+	forked so their interpreters have the module too.
+*/
+void Pawpy::module_register()
+{
+	PyImport_AppendInittab("pawpy", init_pawpy);
+}
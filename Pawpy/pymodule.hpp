@@ -0,0 +1,43 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The "pawpy" module Python code can import to talk back to the plugin.
+		See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_PYMODULE_H
+#define PAWPY_PYMODULE_H
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+
+namespace Pawpy
+{
+
+void module_register();
+
+}
+
+#endif
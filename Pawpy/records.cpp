@@ -0,0 +1,125 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Call records are taken from a free list when a native makes a call and
+		go back on it once the callback has been called, instead of being
+		built from nothing and destroyed every time. A record keeps the memory
+		it had: its argument list and the cells of every argument in it are
+		reused by the next call, so a script that keeps making the same call
+		ends up copying its arguments into buffers that are already big
+		enough. Records are moved between the queues, never copied.
+
+		Records are only taken and given back on the main thread, by natives
+		and ProcessTick, so the free list isn't locked. A worker that drops a
+		call itself (one cancelled before it started) hands its record back
+		through a lock-free queue that the main thread empties onto the free
+		list.
+
+
+==============================================================================*/
+
+
+#include <vector>
+
+using std::vector;
+
+#include "main.hpp"
+
+#include "records.hpp"
+#include "mpsc_queue.hpp"
+
+
+static vector<Pawpy::pycall_t> spare_records;
+static Pawpy::mpsc_queue<Pawpy::pycall_t> returned_records;
+
+
+/*
+	Note:
+	Called once from Load so the free list never has to grow while there are
+	fewer calls in flight than this.
+*/
+void Pawpy::record_reserve(size_t count)
+{
+	spare_records.reserve(count);
+}
+
+/*
+	Note:
+	Returns a record with everything but its buffers reset. arguments still
+	holds the previous call's arguments so their memory can be reused, the
+	caller must fill it in (see Native::extract_arguments) or clear it.
+*/
+Pawpy::pycall_t Pawpy::record_acquire()
+{
+	if(!returned_records.empty())
+		returned_records.drain(spare_records);
+
+	if(spare_records.empty())
+	{
+		pycall_t call;
+		record_reset(call);
+		return call;
+	}
+
+	pycall_t call = std::move(spare_records.back());
+	spare_records.pop_back();
+
+	return call;
+}
+
+void Pawpy::record_release(pycall_t&& call)
+{
+	record_reset(call);
+	spare_records.push_back(std::move(call));
+}
+
+/*
+	Note:
+	record_release for worker threads, the record is reset here and put on
+	the free list by the next record_acquire.
+*/
+void Pawpy::record_return(pycall_t&& call)
+{
+	record_reset(call);
+	returned_records.push(std::move(call));
+}
+
+/*
+	Note:
+	Results are cleared rather than kept since a batch appends to them.
+*/
+void Pawpy::record_reset(pycall_t& call)
+{
+	call.returns.clear();
+	call.results.clear();
+	call.failed = false;
+	call.batch.clear();
+	call.batch_single = false;
+	call.batch_more = false;
+	call.cache_key.clear();
+	call.coalesced = false;
+	call.amx = nullptr;
+	call.id = 0;
+	call.priority = PRIORITY_NORMAL;
+	call.timeout = 0;
+	call.timed_out = false;
+	call.timing = pytiming_t();
+}
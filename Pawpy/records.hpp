@@ -0,0 +1,46 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Recycled call records. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_RECORDS_H
+#define PAWPY_RECORDS_H
+
+#include "main.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+void record_reserve(size_t count);
+pycall_t record_acquire();
+void record_release(pycall_t&& call);
+void record_return(pycall_t&& call);
+void record_reset(pycall_t& call);
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		A FIFO queue in one circular buffer. It replaces std::deque for queues
+		of call records, which are big enough that a deque allocates a new
+		block every one or two items pushed.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_RING_H
+#define PAWPY_RING_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+using std::vector;
+
+
+namespace Pawpy
+{
+
+/*
+	Note:
+	The buffer is always a power of two in size so wrapping around is a mask.
+	It doubles when it's full and never shrinks, so once it has grown to the
+	longest the queue gets nothing is allocated again. Items are moved in and
+	out of slots that stay constructed: pop_front doesn't destroy the front
+	item, it's expected to have been moved out already.
+*/
+template <typename T>
+class ring_queue
+{
+public:
+	ring_queue() : first(0), count(0) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T& front() { return slots[first]; }
+	T& operator[](size_t i) { return slots[(first + i) & (slots.size() - 1)]; }
+
+	void reserve(size_t capacity)
+	{
+		if(capacity > slots.size())
+			grow(capacity);
+	}
+
+	void push_back(T value)
+	{
+		if(count == slots.size())
+			grow(count + 1);
+
+		(*this)[count] = std::move(value);
+		count++;
+	}
+
+	void push_front(T value)
+	{
+		if(count == slots.size())
+			grow(count + 1);
+
+		first = (first - 1) & (slots.size() - 1);
+		slots[first] = std::move(value);
+		count++;
+	}
+
+	void pop_front()
+	{
+		first = (first + 1) & (slots.size() - 1);
+		count--;
+	}
+
+	/*
+		Note:
+		Removes item i, moving everything behind it forward one place.
+	*/
+	void erase(size_t i)
+	{
+		for(; i + 1 < count; ++i)
+			(*this)[i] = std::move((*this)[i + 1]);
+
+		(*this)[count - 1] = T();
+		count--;
+	}
+
+	void clear()
+	{
+		for(size_t i = 0; i < count; ++i)
+			(*this)[i] = T();
+
+		first = 0;
+		count = 0;
+	}
+
+private:
+	void grow(size_t capacity)
+	{
+		size_t size = slots.empty() ? 16 : slots.size();
+
+		while(size < capacity)
+			size *= 2;
+
+		vector<T> grown(size);
+
+		for(size_t i = 0; i < count; ++i)
+			grown[i] = std::move((*this)[i]);
+
+		slots.swap(grown);
+		first = 0;
+	}
+
+	vector<T> slots;
+	size_t first;
+	size_t count;
+};
+
+}
+
+#endif
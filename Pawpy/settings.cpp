@@ -0,0 +1,138 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Reads "pawpy_" prefixed settings from server.cfg. The format is the same
+		as every other server.cfg line: a key, a space then the value.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+using std::string;
+
+#include "settings.hpp"
+
+
+/*
+	Note:
+	Defaults used when server.cfg doesn't mention a setting. The worker count
+	is filled in from the hardware in load_settings.
+*/
+Pawpy::settings_t Pawpy::settings =
+{
+	0,		// workers
+	1024,	// queue_depth
+	2000,	// tick_budget
+	false,	// subinterpreters
+	0,		// processes
+	1000,	// async_inflight
+	4096,	// cache_entries
+	0,		// stats_interval
+	60		// error_interval
+};
+
+void Pawpy::load_settings(string filename)
+{
+	settings.workers = std::thread::hardware_concurrency();
+
+	if(settings.workers < 2)
+		settings.workers = 2;
+
+	std::ifstream file(filename);
+
+	if(!file.is_open())
+	{
+		debug("load_settings: unable to open '%s', using defaults", filename.c_str());
+		return;
+	}
+
+	string line;
+	string key;
+	long value;
+
+	while(std::getline(file, line))
+	{
+		if(line.compare(0, 6, "pawpy_") != 0)
+			continue;
+
+		std::istringstream stream(line);
+
+		if(!(stream >> key >> value))
+		{
+			samp_printf("ERROR: Invalid Pawpy setting line in %s: '%s'", filename.c_str(), line.c_str());
+			continue;
+		}
+
+		if(value < 0)
+		{
+			samp_printf("ERROR: Pawpy setting '%s' cannot be negative.", key.c_str());
+			continue;
+		}
+
+		if(key == "pawpy_workers")
+		{
+			if(value > 0)
+				settings.workers = value;
+		}
+		else if(key == "pawpy_queue_depth")
+		{
+			if(value > 0)
+				settings.queue_depth = value;
+		}
+		else if(key == "pawpy_tick_budget")
+		{
+			settings.tick_budget = value;
+		}
+		else if(key == "pawpy_subinterpreters")
+		{
+			settings.subinterpreters = value != 0;
+		}
+		else if(key == "pawpy_processes")
+		{
+			settings.processes = value;
+		}
+		else if(key == "pawpy_async_inflight")
+		{
+			settings.async_inflight = value;
+		}
+		else if(key == "pawpy_cache_entries")
+		{
+			settings.cache_entries = value;
+		}
+		else if(key == "pawpy_stats_interval")
+		{
+			settings.stats_interval = value;
+		}
+		else if(key == "pawpy_error_interval")
+		{
+			settings.error_interval = value;
+		}
+		else
+		{
+			samp_printf("ERROR: Unknown Pawpy setting '%s'.", key.c_str());
+		}
+	}
+}
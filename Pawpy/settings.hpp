@@ -0,0 +1,116 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Plugin settings. These are read once from the SA:MP server.cfg file when
+		the plugin loads, any line starting with "pawpy_" is treated as a Pawpy
+		setting. Anything not specified keeps the default value.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_SETTINGS_H
+#define PAWPY_SETTINGS_H
+
+#include <string>
+
+using std::string;
+
+#include "main.hpp"
+
+
+namespace Pawpy
+{
+
+struct settings_t
+{
+	/*
+		Note:
+		Number of long-lived worker threads that run Python calls and the
+		maximum number of calls that may be waiting for a free worker. When the
+		job queue is full, RunPythonThreaded fails instead of blocking the
+		server.
+	*/
+	unsigned int workers;
+	unsigned int queue_depth;
+
+	/*
+		Note:
+		How long, in microseconds, ProcessTick may spend delivering callbacks
+		each server tick. Results that don't fit are delivered next tick. Zero
+		means no limit.
+	*/
+	unsigned int tick_budget;
+
+	/*
+		Note:
+		When enabled (and running on Python 3.12 or newer) every worker runs
+		its own subinterpreter with its own GIL so Python code actually runs
+		in parallel. Modules are imported separately in each worker.
+	*/
+	bool subinterpreters;
+
+	/*
+		Note:
+		Number of separate worker processes to run threaded calls in instead
+		of the worker threads. Each one has its own interpreter and crashes in
+		Python code or C extensions only take down that process, which is
+		restarted automatically. Zero turns it off. Linux only.
+	*/
+	unsigned int processes;
+
+	/*
+		Note:
+		Maximum number of async def calls running on the asyncio event loop at
+		once. Past this, coroutines are run on the worker that called them.
+		Zero disables the event loop entirely.
+	*/
+	unsigned int async_inflight;
+
+	/*
+		Note:
+		Maximum number of results kept in the result cache before the least
+		recently used are evicted. Zero disables the cache.
+	*/
+	unsigned int cache_entries;
+
+	/*
+		Note:
+		How often, in seconds, a summary of the call metrics is printed to the
+		server log. Zero turns it off.
+	*/
+	unsigned int stats_interval;
+
+	/*
+		Note:
+		How long, in seconds, repeats of an error are only counted after it's
+		been logged, see errors.cpp. Zero logs every error.
+	*/
+	unsigned int error_interval;
+};
+
+extern settings_t settings;
+
+void load_settings(string filename);
+
+}
+
+#endif
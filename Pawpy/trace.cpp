@@ -0,0 +1,450 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Call lifecycle tracing. While a trace is running every call records when
+		it went through each stage: the native, waiting for a worker, waiting
+		for the GIL, importing and looking up the function, running it, waiting
+		for ProcessTick and running the callback. These end up in a Chrome trace
+		file (the JSON format chrome://tracing and ui.perfetto.dev open) so a
+		slow tick can be lined up against what every thread was doing at the
+		time.
+
+		Each thread writes its events into a buffer of its own that only it
+		adds to and only the writer thread takes from, so recording an event is
+		a copy and an atomic store. The writer empties them into the file in
+		the background. A full buffer drops events rather than waiting, the
+		number dropped is printed when the trace stops.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+using std::string;
+using std::vector;
+using std::thread;
+using std::mutex;
+
+#include "main.hpp"
+
+#include "trace.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+std::atomic<bool> Pawpy::trace_active(false);
+
+/*
+	Note:
+	One recorded event. Names are stored as their interned keys (see names.cpp)
+	and only turned back into strings by the writer. Async events are a span
+	that isn't tied to one thread, such as a call waiting in a queue, they're
+	written as a begin and end pair matched by the call ID.
+*/
+struct trace_event_t
+{
+	const char* name;
+	bool async;
+	unsigned int module;
+	unsigned int function;
+	cell id;
+	clock_type::time_point begin;
+	clock_type::time_point end;
+};
+
+/*
+	Note:
+	A thread's events. head is only written by the owning thread and tail only
+	by whoever is emptying it, which is the writer thread while a trace is
+	running. Buffers are never freed before trace_shutdown since the thread
+	keeps a pointer to its own for as long as it lives.
+*/
+static const size_t TRACE_BUFFER_SIZE = 16384;
+
+struct trace_buffer_t
+{
+	trace_event_t events[TRACE_BUFFER_SIZE];
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::thread::id thread_id;
+	unsigned int tid;
+};
+
+static mutex buffers_mutex;
+static vector<std::unique_ptr<trace_buffer_t>> buffers;
+static thread_local trace_buffer_t* local_buffer = nullptr;
+
+/*
+	Note:
+	The file and writer thread of the running trace. trace_mutex only protects
+	the writer's sleep, the file is only touched by the writer while it runs
+	and by trace_start and trace_stop around it.
+*/
+static mutex trace_mutex;
+static std::condition_variable trace_cv;
+static bool writer_running = false;
+static thread writer_thread;
+static FILE* trace_file = nullptr;
+static string trace_filename;
+static clock_type::time_point trace_origin;
+static std::thread::id trace_main_thread;
+static bool trace_first = true;
+static size_t trace_written = 0;
+static std::atomic<unsigned int> trace_dropped(0);
+
+
+static trace_buffer_t* get_buffer()
+{
+	if(local_buffer != nullptr)
+		return local_buffer;
+
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+
+	buffers.push_back(std::unique_ptr<trace_buffer_t>(new trace_buffer_t));
+
+	local_buffer = buffers.back().get();
+	local_buffer->head = 0;
+	local_buffer->tail = 0;
+	local_buffer->thread_id = std::this_thread::get_id();
+	local_buffer->tid = buffers.size();
+
+	return local_buffer;
+}
+
+static void record(const char* name, bool async, Pawpy::name_t module, Pawpy::name_t function, cell id, clock_type::time_point begin, clock_type::time_point end)
+{
+	trace_buffer_t* buffer = get_buffer();
+	size_t head = buffer->head.load(std::memory_order_relaxed);
+
+	if(head - buffer->tail.load(std::memory_order_acquire) >= TRACE_BUFFER_SIZE)
+	{
+		trace_dropped++;
+		return;
+	}
+
+	trace_event_t& event = buffer->events[head % TRACE_BUFFER_SIZE];
+
+	event.name = name;
+	event.async = async;
+	event.module = module.key();
+	event.function = function.key();
+	event.id = id;
+	event.begin = begin;
+	event.end = end;
+
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+/*
+	Note:
+	Names come from scripts so they're escaped, even though anything that
+	needs it would never have resolved to a Python function.
+*/
+static void write_string(const string& text)
+{
+	for(char c : text)
+	{
+		if(c == '"' || c == '\\')
+			fprintf(trace_file, "\\%c", c);
+		else if(static_cast<unsigned char>(c) < 0x20)
+			fprintf(trace_file, "\\u%04x", c);
+		else
+			fputc(c, trace_file);
+	}
+}
+
+/*
+	Note:
+	Timestamps are in microseconds since the trace started. Anything that
+	began before that is cut off at the start.
+*/
+static double trace_time(clock_type::time_point time)
+{
+	if(time < trace_origin)
+		return 0.0;
+
+	return std::chrono::duration<double, std::micro>(time - trace_origin).count();
+}
+
+static void write_separator()
+{
+	if(!trace_first)
+		fputs(",\n", trace_file);
+
+	trace_first = false;
+}
+
+static void write_args(const trace_event_t& event)
+{
+	fprintf(trace_file, ",\"args\":{\"call\":%d,\"name\":\"", event.id);
+
+	if(event.module != 0)
+	{
+		write_string(Pawpy::name_string(event.module));
+		fputc('.', trace_file);
+	}
+
+	write_string(Pawpy::name_string(event.function));
+	fputs("\"}}", trace_file);
+}
+
+static void write_event(const trace_event_t& event, unsigned int tid)
+{
+	double begin = trace_time(event.begin);
+	double end = trace_time(event.end);
+
+	if(end < begin)
+		end = begin;
+
+	if(event.async)
+	{
+		write_separator();
+		fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"call\",\"ph\":\"b\",\"id\":%d,\"pid\":1,\"tid\":%u,\"ts\":%.3f", event.name, event.id, tid, begin);
+		write_args(event);
+
+		write_separator();
+		fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"call\",\"ph\":\"e\",\"id\":%d,\"pid\":1,\"tid\":%u,\"ts\":%.3f}", event.name, event.id, tid, end);
+	}
+	else
+	{
+		write_separator();
+		fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", event.name, tid, begin, end - begin);
+
+		if(event.id == 0 && event.function == 0)
+			fputc('}', trace_file);
+		else
+			write_args(event);
+	}
+
+	trace_written++;
+}
+
+/*
+	Note:
+	Writes out everything the threads have recorded so far, or throws it away
+	when there's no file to write to.
+*/
+static void drain_buffers()
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+
+	for(auto& buffer : buffers)
+	{
+		size_t tail = buffer->tail.load(std::memory_order_relaxed);
+		size_t head = buffer->head.load(std::memory_order_acquire);
+
+		if(trace_file != nullptr)
+		{
+			for(; tail != head; ++tail)
+				write_event(buffer->events[tail % TRACE_BUFFER_SIZE], buffer->tid);
+		}
+
+		buffer->tail.store(head, std::memory_order_release);
+	}
+}
+
+static void trace_writer()
+{
+	std::unique_lock<std::mutex> lock(trace_mutex);
+
+	while(writer_running)
+	{
+		trace_cv.wait_for(lock, std::chrono::milliseconds(100));
+
+		drain_buffers();
+	}
+}
+
+/*
+	Note:
+	Starts writing a trace to filename, replacing it if it exists. Fails if a
+	trace is already running or the file can't be opened. Called from the
+	main thread, which is named "server" in the trace.
+*/
+bool Pawpy::trace_start(const string& filename)
+{
+	if(writer_running)
+	{
+		samp_printf("ERROR: A Python trace is already being written to '%s'.", trace_filename.c_str());
+		return false;
+	}
+
+	/*
+		Note:
+		Anything recorded after the last trace stopped is thrown away first.
+	*/
+	drain_buffers();
+
+	trace_file = fopen(filename.c_str(), "w");
+
+	if(trace_file == nullptr)
+	{
+		samp_printf("ERROR: Unable to open '%s' to write a Python trace to.", filename.c_str());
+		return false;
+	}
+
+	fputs("{\"traceEvents\":[\n", trace_file);
+
+	trace_filename = filename;
+	trace_origin = clock_type::now();
+	trace_main_thread = std::this_thread::get_id();
+	trace_first = true;
+	trace_written = 0;
+	trace_dropped = 0;
+
+	writer_running = true;
+	writer_thread = thread(trace_writer);
+
+	trace_active = true;
+
+	return true;
+}
+
+/*
+	Note:
+	Stops the trace, writes out whatever is left and closes the file. Returns
+	false if there was no trace running.
+*/
+bool Pawpy::trace_stop()
+{
+	if(!writer_running)
+		return false;
+
+	trace_active = false;
+
+	{
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		writer_running = false;
+	}
+
+	trace_cv.notify_one();
+	writer_thread.join();
+
+	drain_buffers();
+
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+
+		for(auto& buffer : buffers)
+		{
+			write_separator();
+
+			if(buffer->thread_id == trace_main_thread)
+				fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"server\"}}", buffer->tid);
+			else
+				fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"pawpy %u\"}}", buffer->tid, buffer->tid);
+		}
+	}
+
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", trace_file);
+	fclose(trace_file);
+	trace_file = nullptr;
+
+	samp_printf("Pawpy: trace saved to '%s', %u events, %u dropped.", trace_filename.c_str(), static_cast<unsigned int>(trace_written), trace_dropped.load());
+
+	return true;
+}
+
+/*
+	Note:
+	Called last in Unload once every other thread is gone, finishes a trace
+	that's still running and frees the buffers.
+*/
+void Pawpy::trace_shutdown()
+{
+	trace_stop();
+
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	buffers.clear();
+	local_buffer = nullptr;
+}
+
+/*
+	Note:
+	A span on the calling thread's own track.
+*/
+void Pawpy::trace_span(const char* name, name_t module, name_t function, cell id, clock_type::time_point begin, clock_type::time_point end)
+{
+	record(name, false, module, function, id, begin, end);
+}
+
+/*
+	Note:
+	A span that belongs to the call rather than a thread, shown on a track of
+	its own per call.
+*/
+void Pawpy::trace_async(const char* name, name_t module, name_t function, cell id, clock_type::time_point begin, clock_type::time_point end)
+{
+	record(name, true, module, function, id, begin, end);
+}
+
+/*
+	Note:
+	Records everything a worker did with a call once it's finished with it.
+	Calls that a worker picked up (see python_thread) have a dequeued time,
+	resolved is only set while tracing since it's not needed for anything
+	else. A function that was already imported resolves almost instantly so
+	its lookup span is tiny, a slow first call shows up as a long one.
+*/
+void Pawpy::trace_worker(const pycall_t& call)
+{
+	const pytiming_t& timing = call.timing;
+
+	if(timing.dequeued == clock_type::time_point())
+		return;
+
+	trace_async("queued", call.module, call.function, call.id, timing.submitted, timing.dequeued);
+
+	if(timing.acquired == clock_type::time_point())
+		return;
+
+	trace_span("gil", call.module, call.function, call.id, timing.dequeued, timing.acquired);
+
+	clock_type::time_point started = timing.acquired;
+
+	if(timing.resolved != clock_type::time_point())
+	{
+		trace_span("lookup", call.module, call.function, call.id, timing.acquired, timing.resolved);
+		started = timing.resolved;
+	}
+
+	trace_span("python", call.module, call.function, call.id, started, timing.finished);
+}
+
+/*
+	Note:
+	Records a result's wait for ProcessTick and its callback, start is when
+	deliver_result began working on it.
+*/
+void Pawpy::trace_delivery(const pycall_t& call, clock_type::time_point start)
+{
+	trace_async("result", call.module, call.function, call.id, call.timing.finished, start);
+	trace_span("callback", name_t(), call.callback, call.id, start, clock_type::now());
+}
@@ -0,0 +1,69 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Optional tracing of every call's lifecycle into a Chrome trace file,
+		which can be opened in chrome://tracing or ui.perfetto.dev. See the
+		.cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_TRACE_H
+#define PAWPY_TRACE_H
+
+#include <string>
+#include <atomic>
+#include <chrono>
+
+using std::string;
+
+#include "main.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+extern std::atomic<bool> trace_active;
+
+/*
+	Note:
+	Every trace point is wrapped in a check of this, so while tracing is off
+	each one costs a load and a branch and nothing else.
+*/
+inline bool tracing()
+{
+	return trace_active.load(std::memory_order_relaxed);
+}
+
+bool trace_start(const string& filename);
+bool trace_stop();
+void trace_shutdown();
+
+void trace_span(const char* name, name_t module, name_t function, cell id, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+void trace_async(const char* name, name_t module, name_t function, cell id, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+void trace_worker(const pycall_t& call);
+void trace_delivery(const pycall_t& call, std::chrono::steady_clock::time_point start);
+
+}
+
+#endif
@@ -0,0 +1,203 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		A thread that wakes up every few milliseconds and looks for calls that
+		have been running for longer than their timeout. It raises a
+		TimeoutError inside each one with PyThreadState_SetAsyncExc, the call
+		fails like it raised the error itself and its callback is told it
+		timed out.
+
+		The exception is only noticed while the thread is running Python code,
+		a call blocked inside C (a socket read without a timeout, time.sleep)
+		stops as soon as that returns to Python. async def functions on the
+		event loop are wrapped in asyncio.wait_for instead, see eventloop.cpp.
+		Calls in worker processes and batches aren't given timeouts.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::thread;
+using std::mutex;
+
+#include "main.hpp"
+#include "python_meta.hpp"
+
+#include "watchdog.hpp"
+#include "callstate.hpp"
+
+
+/*
+	Note:
+	Module defaults and the timeout count are only touched by the main
+	thread. Timeouts per function are counted with the other metrics, see
+	metrics.cpp.
+*/
+unsigned int Pawpy::timeouts_total = 0;
+
+static map<string, unsigned int> module_timeouts;
+
+static thread watchdog_thread;
+static mutex watchdog_mutex;
+static std::condition_variable watchdog_cv;
+static bool watchdog_running = false;
+
+/*
+	Note:
+	How often running calls are checked, which is also roughly how late a
+	timeout can be.
+*/
+static const std::chrono::milliseconds watchdog_interval(10);
+
+/*
+	Note:
+	The watchdog's own thread state in every interpreter it has had to raise
+	a timeout in. A worker with its own subinterpreter has its own GIL and
+	the exception has to be raised from inside that interpreter.
+*/
+static map<PyInterpreterState*, PyThreadState*> watchdog_states;
+
+
+static void raise_timeout(const Pawpy::call_expired_t& expired)
+{
+	PyThreadState*& state = watchdog_states[expired.interpreter];
+
+	if(state == nullptr)
+		state = PyThreadState_New(expired.interpreter);
+
+	PyEval_RestoreThread(state);
+
+	if(Pawpy::call_expire(expired))
+		PyThreadState_SetAsyncExc(expired.thread, PyExc_TimeoutError);
+
+	PyEval_SaveThread();
+}
+
+static void watchdog_body()
+{
+	vector<Pawpy::call_expired_t> expired;
+
+	std::unique_lock<mutex> lock(watchdog_mutex);
+
+	while(watchdog_running)
+	{
+		watchdog_cv.wait_for(lock, watchdog_interval);
+
+		/*
+			Note:
+			Raising a timeout waits for the GIL, which the call that's being
+			timed out may hold for a while. The lock is dropped meanwhile so
+			watchdog_stop isn't held up by it.
+		*/
+		lock.unlock();
+
+		expired.clear();
+		Pawpy::call_expired(expired);
+
+		for(auto& call : expired)
+			raise_timeout(call);
+
+		lock.lock();
+	}
+
+	lock.unlock();
+
+	for(auto& state : watchdog_states)
+	{
+		PyEval_RestoreThread(state.second);
+		PyThreadState_Clear(state.second);
+		PyThreadState_DeleteCurrent();
+	}
+
+	watchdog_states.clear();
+}
+
+/*
+	Note:
+	Called from Load once the interpreter is ready.
+*/
+void Pawpy::watchdog_start()
+{
+	watchdog_running = true;
+	watchdog_thread = thread(watchdog_body);
+}
+
+/*
+	Note:
+	Must be called before the workers are stopped, a subinterpreter can't be
+	ended while the watchdog still has a thread state in it.
+*/
+void Pawpy::watchdog_stop()
+{
+	{
+		std::lock_guard<mutex> lock(watchdog_mutex);
+		watchdog_running = false;
+	}
+
+	watchdog_cv.notify_all();
+	watchdog_thread.join();
+}
+
+/*
+	Note:
+	The timeout, in milliseconds, given to every threaded call to the module
+	unless the script sets one for the call itself. Zero removes it.
+*/
+void Pawpy::set_module_timeout(const string& module, unsigned int timeout)
+{
+	if(timeout > 0)
+		module_timeouts[module] = timeout;
+	else
+		module_timeouts.erase(module);
+}
+
+unsigned int Pawpy::module_timeout(const string& module)
+{
+	if(module_timeouts.empty())
+		return 0;
+
+	auto found = module_timeouts.find(module);
+
+	if(found == module_timeouts.end())
+		return 0;
+
+	return found->second;
+}
+
+/*
+	Note:
+	Called by collect_results for every call that timed out.
+*/
+void Pawpy::record_timeout()
+{
+	timeouts_total++;
+}
@@ -0,0 +1,54 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		The watchdog. Calls can be given a timeout and one that runs past it
+		has a TimeoutError raised inside it, so a hung call can't hold a
+		worker forever. See the .cpp for details.
+
+
+==============================================================================*/
+
+
+#ifndef PAWPY_WATCHDOG_H
+#define PAWPY_WATCHDOG_H
+
+#include <string>
+
+using std::string;
+
+#include "main.hpp"
+#include "pawpy.hpp"
+
+
+namespace Pawpy
+{
+
+extern unsigned int timeouts_total;
+
+void watchdog_start();
+void watchdog_stop();
+void set_module_timeout(const string& module, unsigned int timeout);
+unsigned int module_timeout(const string& module);
+void record_timeout();
+
+}
+
+#endif
@@ -0,0 +1,1152 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn - load test harness
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Drives the plugin without a SA:MP server so performance can be measured
+		(and regressions caught) anywhere. The plugin is loaded with dlopen
+		and given a mock AMX that implements the parts of the AMX API the
+		plugin uses: registering natives, finding and executing publics,
+		pushing parameters and reading and writing strings and arrays.
+
+		Load, AmxLoad and ProcessTick are called just like the server calls
+		them, at a fixed tick rate, while a workload submits calls through the
+		RunPythonThreaded or RunPython native. Workload functions live in
+		bench.py next to this file, run the harness from this directory so
+		the plugin finds it (and any server.cfg with pawpy_ settings).
+
+		Build with "make bench" from the repository root, then for example:
+
+			cd Test/bench
+			../../pawpy-bench ../../pawpy.so --workload cpu --calls 20000
+
+		It reports throughput, end-to-end latency percentiles (from the
+		native call until the callback runs), how long each server tick
+		spent in the plugin (submitting calls plus ProcessTick), how many
+		times and with how much AMX heap the callback was called and how many
+		C++ heap allocations each call made once the plugin had warmed up.
+		--batch compares one RunPythonBatch per tick with a loop of
+		RunPythonThreaded calls. With --trace the run is also recorded with
+		StartPythonTrace.
+		--workers and --subinterpreters override those server.cfg settings
+		for one run.
+		Linux only.
+
+
+==============================================================================*/
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <fstream>
+#include <dlfcn.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::map;
+
+#include <amx/amx.h>
+#include <plugincommon.h>
+
+
+typedef std::chrono::steady_clock clock_type;
+
+
+/*
+	Note:
+	Every C++ heap allocation in the process. The harness is linked with
+	-rdynamic so the plugin's operator new resolves to this one too, and the
+	main loop counts what one call costs once everything has warmed up.
+	Python's own allocator isn't included.
+*/
+static std::atomic<unsigned long> allocations(0);
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	void* memory = malloc(size > 0 ? size : 1);
+
+	if(memory == nullptr)
+		throw std::bad_alloc();
+
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+typedef bool (PLUGIN_CALL *Load_t)(void** data);
+typedef void (PLUGIN_CALL *Unload_t)();
+typedef unsigned int (PLUGIN_CALL *Supports_t)();
+typedef int (PLUGIN_CALL *AmxLoad_t)(AMX* amx);
+typedef int (PLUGIN_CALL *AmxUnload_t)(AMX* amx);
+typedef void (PLUGIN_CALL *ProcessTick_t)();
+
+
+/*==============================================================================
+
+	Mock AMX
+
+==============================================================================*/
+
+
+/*
+	Note:
+	The AMX is the first member so the plugin's AMX pointer can be turned
+	back into the mock. Memory is one block of cells addressed in bytes like
+	a real AMX data section: the bottom holds the strings and arguments the
+	harness sets up, the heap above it is used for callback parameters.
+	Parameters pushed for amx_Exec are kept in a separate list.
+*/
+struct mock_amx_t
+{
+	AMX amx;
+	vector<cell> memory;
+	cell data_top;
+	cell heap_base;
+	cell heap_top;
+	vector<cell> pushed;
+	map<string, AMX_NATIVE> natives;
+	vector<string> public_names;
+};
+
+static const cell MOCK_MEMORY_CELLS = 1 << 20;
+
+/*
+	Note:
+	What the callback does with its parameters, set up by main.
+*/
+static void (*on_result)(mock_amx_t& mock, const vector<cell>& params) = nullptr;
+
+
+static mock_amx_t* mock_of(AMX* amx)
+{
+	return reinterpret_cast<mock_amx_t*>(amx);
+}
+
+static cell* mock_address(mock_amx_t& mock, cell address)
+{
+	return &mock.memory[address / sizeof(cell)];
+}
+
+static int mock_Allot(AMX* amx, int cells, cell* amx_addr, cell** phys_addr)
+{
+	mock_amx_t& mock = *mock_of(amx);
+
+	if(mock.heap_top + cells * static_cast<cell>(sizeof(cell)) > MOCK_MEMORY_CELLS * static_cast<cell>(sizeof(cell)))
+		return AMX_ERR_MEMORY;
+
+	*amx_addr = mock.heap_top;
+
+	if(phys_addr != nullptr)
+		*phys_addr = mock_address(mock, mock.heap_top);
+
+	mock.heap_top += cells * sizeof(cell);
+	amx->hea = mock.heap_top;
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_Release(AMX* amx, cell amx_addr)
+{
+	mock_amx_t& mock = *mock_of(amx);
+
+	if(amx_addr >= mock.heap_base && amx_addr < mock.heap_top)
+		mock.heap_top = amx_addr;
+
+	amx->hea = mock.heap_top;
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_Push(AMX* amx, cell value)
+{
+	mock_of(amx)->pushed.push_back(value);
+	return AMX_ERR_NONE;
+}
+
+static int mock_PushArray(AMX* amx, cell* amx_addr, cell** phys_addr, const cell array[], int numcells)
+{
+	cell* physical;
+	int error = mock_Allot(amx, numcells, amx_addr, &physical);
+
+	if(error != AMX_ERR_NONE)
+		return error;
+
+	if(array != nullptr)
+		memcpy(physical, array, numcells * sizeof(cell));
+
+	if(phys_addr != nullptr)
+		*phys_addr = physical;
+
+	return mock_Push(amx, *amx_addr);
+}
+
+static int mock_PushString(AMX* amx, cell* amx_addr, cell** phys_addr, const char* string, int pack, int use_wchar)
+{
+	int length = strlen(string) + 1;
+	cell* physical;
+	int error = mock_Allot(amx, length, amx_addr, &physical);
+
+	if(error != AMX_ERR_NONE)
+		return error;
+
+	for(int i = 0; i < length; ++i)
+		physical[i] = static_cast<unsigned char>(string[i]);
+
+	if(phys_addr != nullptr)
+		*phys_addr = physical;
+
+	return mock_Push(amx, *amx_addr);
+}
+
+/*
+	Note:
+	Parameters were pushed last to first, the callback gets them first to
+	last like a Pawn public would.
+*/
+static int mock_Exec(AMX* amx, cell* retval, int index)
+{
+	mock_amx_t& mock = *mock_of(amx);
+	static vector<cell> params;
+
+	params.assign(mock.pushed.rbegin(), mock.pushed.rend());
+	mock.pushed.clear();
+
+	if(index < 0 || index >= static_cast<int>(mock.public_names.size()))
+		return AMX_ERR_INDEX;
+
+	if(on_result != nullptr)
+		on_result(mock, params);
+
+	if(retval != nullptr)
+		*retval = 0;
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_FindPublic(AMX* amx, const char* funcname, int* index)
+{
+	mock_amx_t& mock = *mock_of(amx);
+
+	for(size_t i = 0; i < mock.public_names.size(); ++i)
+	{
+		if(mock.public_names[i] == funcname)
+		{
+			*index = i;
+			return AMX_ERR_NONE;
+		}
+	}
+
+	return AMX_ERR_NOTFOUND;
+}
+
+static int mock_GetAddr(AMX* amx, cell amx_addr, cell** phys_addr)
+{
+	mock_amx_t& mock = *mock_of(amx);
+
+	if(amx_addr < 0 || amx_addr >= MOCK_MEMORY_CELLS * static_cast<cell>(sizeof(cell)))
+		return AMX_ERR_MEMACCESS;
+
+	*phys_addr = mock_address(mock, amx_addr);
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_Register(AMX* amx, const AMX_NATIVE_INFO* list, int number)
+{
+	mock_amx_t& mock = *mock_of(amx);
+
+	for(int i = 0; (number < 0 || i < number) && list[i].name != nullptr; ++i)
+		mock.natives[list[i].name] = list[i].func;
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_StrLen(const cell* cstring, int* length)
+{
+	int i = 0;
+
+	while(cstring[i] != 0)
+		++i;
+
+	*length = i;
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_GetString(char* dest, const cell* source, int use_wchar, size_t size)
+{
+	size_t i = 0;
+
+	for(; source[i] != 0 && i + 1 < size; ++i)
+		dest[i] = static_cast<char>(source[i]);
+
+	dest[i] = '\0';
+
+	return AMX_ERR_NONE;
+}
+
+static int mock_SetString(cell* dest, const char* source, int pack, int use_wchar, size_t size)
+{
+	size_t i = 0;
+
+	for(; source[i] != '\0' && i + 1 < size; ++i)
+		dest[i] = static_cast<unsigned char>(source[i]);
+
+	dest[i] = 0;
+
+	return AMX_ERR_NONE;
+}
+
+/*
+	Note:
+	The table the server hands plugins in Load, only the functions the plugin
+	uses are filled in.
+*/
+static void* amx_exports[PLUGIN_AMX_EXPORT_UTF8Put + 1];
+
+static void setup_exports()
+{
+	amx_exports[PLUGIN_AMX_EXPORT_Allot] = reinterpret_cast<void*>(mock_Allot);
+	amx_exports[PLUGIN_AMX_EXPORT_Exec] = reinterpret_cast<void*>(mock_Exec);
+	amx_exports[PLUGIN_AMX_EXPORT_FindPublic] = reinterpret_cast<void*>(mock_FindPublic);
+	amx_exports[PLUGIN_AMX_EXPORT_GetAddr] = reinterpret_cast<void*>(mock_GetAddr);
+	amx_exports[PLUGIN_AMX_EXPORT_GetString] = reinterpret_cast<void*>(mock_GetString);
+	amx_exports[PLUGIN_AMX_EXPORT_Push] = reinterpret_cast<void*>(mock_Push);
+	amx_exports[PLUGIN_AMX_EXPORT_PushArray] = reinterpret_cast<void*>(mock_PushArray);
+	amx_exports[PLUGIN_AMX_EXPORT_PushString] = reinterpret_cast<void*>(mock_PushString);
+	amx_exports[PLUGIN_AMX_EXPORT_Register] = reinterpret_cast<void*>(mock_Register);
+	amx_exports[PLUGIN_AMX_EXPORT_Release] = reinterpret_cast<void*>(mock_Release);
+	amx_exports[PLUGIN_AMX_EXPORT_SetString] = reinterpret_cast<void*>(mock_SetString);
+	amx_exports[PLUGIN_AMX_EXPORT_StrLen] = reinterpret_cast<void*>(mock_StrLen);
+}
+
+static mock_amx_t* mock_create()
+{
+	mock_amx_t* mock = new mock_amx_t();
+
+	memset(&mock->amx, 0, sizeof(AMX));
+	mock->memory.assign(MOCK_MEMORY_CELLS, 0);
+	mock->data_top = sizeof(cell);
+	mock->heap_base = MOCK_MEMORY_CELLS / 2 * sizeof(cell);
+	mock->heap_top = mock->heap_base;
+	mock->amx.hea = mock->heap_top;
+
+	return mock;
+}
+
+/*
+	Note:
+	Places values in the data section and returns their address, the way a
+	script's global strings and arrays would be laid out.
+*/
+static cell mock_data(mock_amx_t& mock, const vector<cell>& values)
+{
+	cell address = mock.data_top;
+
+	memcpy(mock_address(mock, address), values.data(), values.size() * sizeof(cell));
+	mock.data_top += values.size() * sizeof(cell);
+
+	return address;
+}
+
+static cell mock_string(mock_amx_t& mock, const string& value)
+{
+	vector<cell> cells(value.begin(), value.end());
+
+	cells.push_back(0);
+
+	return mock_data(mock, cells);
+}
+
+static AMX_NATIVE mock_find_native(mock_amx_t& mock, const string& name)
+{
+	auto found = mock.natives.find(name);
+
+	if(found == mock.natives.end())
+	{
+		fprintf(stderr, "The plugin didn't register %s.\n", name.c_str());
+		exit(1);
+	}
+
+	return found->second;
+}
+
+/*
+	Note:
+	Calls a native with the parameter block laid out like the AMX does it, a
+	byte count followed by the parameters. The block is reused so calling a
+	native doesn't allocate anything in the harness itself.
+*/
+static cell mock_native(mock_amx_t& mock, AMX_NATIVE native, const vector<cell>& args)
+{
+	static vector<cell> params;
+
+	params.clear();
+	params.push_back(args.size() * sizeof(cell));
+	params.insert(params.end(), args.begin(), args.end());
+
+	return native(&mock.amx, params.data());
+}
+
+
+/*==============================================================================
+
+	Workloads and measurement
+
+==============================================================================*/
+
+
+/*
+	Note:
+	GetPythonStat stats the harness reports, numbered as in pawpy.inc.
+*/
+enum
+{
+	PY_STAT_WORKERS = 0,
+	PY_STAT_ISOLATED_WORKERS = 8
+};
+
+enum
+{
+	PY_BATCH_EACH,
+	PY_BATCH_SINGLE
+};
+
+/*
+	Note:
+	Command line options, see usage().
+*/
+struct options_t
+{
+	string plugin;
+	string workload;
+	string mode;
+	unsigned int calls;
+	unsigned int per_tick;
+	unsigned int tick_rate;
+	unsigned int cpu_iterations;
+	unsigned int sleep_ms;
+	unsigned int array_size;
+	unsigned int timeout;
+	unsigned int workers;
+	string subinterpreters;
+	string batch;
+	string trace;
+	bool batched;
+	bool quiet;
+};
+
+static options_t options =
+{
+	"",			// plugin
+	"noop",		// workload
+	"threaded",	// mode
+	10000,		// calls
+	100,		// per_tick
+	200,		// tick_rate
+	10000,		// cpu_iterations
+	10,			// sleep_ms
+	1000,		// array_size
+	60,			// timeout
+	0,			// workers
+	"",			// subinterpreters
+	"",			// batch
+	"",			// trace
+	false,		// batched
+	false		// quiet
+};
+
+/*
+	Note:
+	Submission time of every threaded call, indexed by call ID from the first
+	call's ID (IDs are handed out in order), how many results each call still
+	owes (a batch is one call with many items) and what's been measured so
+	far.
+	Everything is sized up front so the harness doesn't allocate while it's
+	measuring, see allocations below.
+*/
+static vector<clock_type::time_point> submit_times;
+static vector<unsigned int> submit_items;
+static cell first_id = 0;
+static unsigned int in_flight = 0;
+static vector<double> latencies;
+static vector<double> tick_times;
+static unsigned int completed = 0;
+static unsigned int failed = 0;
+static unsigned int rejected = 0;
+static unsigned int callback_execs = 0;
+static cell heap_peak = 0;
+
+static void bench_logprintf(char* format, ...)
+{
+	if(options.quiet)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+
+	printf("\n");
+}
+
+/*
+	Note:
+	Records results for a call, every item of a batch counts as a call of its
+	own with the batch's latency. Every workload function returns a non-empty
+	string (or a non-zero int for --batch) so an empty one means it failed.
+*/
+static void result_landed(cell id, unsigned int items, unsigned int failures)
+{
+	size_t index = id - first_id;
+
+	if(id < first_id || index >= submit_times.size() || submit_items[index] < items || items == 0)
+		return;
+
+	std::chrono::duration<double, std::milli> latency = clock_type::now() - submit_times[index];
+
+	for(unsigned int i = 0; i < items; ++i)
+		latencies.push_back(latency.count());
+
+	submit_items[index] -= items;
+	in_flight -= items;
+	completed += items;
+	failed += failures;
+}
+
+/*
+	Note:
+	The callback, (module[], result[], length, id), with --batch (value, id)
+	or for --batch single (results[], count, failures, id), or with --batched
+	(ids[], offsets[], data[], count) once per tick.
+*/
+static void result_received(mock_amx_t& mock, const vector<cell>& params)
+{
+	cell heap_used = mock.heap_top - mock.heap_base;
+
+	callback_execs++;
+
+	if(heap_used > heap_peak)
+		heap_peak = heap_used;
+
+	if(options.batched)
+	{
+		if(params.size() < 4)
+			return;
+
+		cell* ids = mock_address(mock, params[0]);
+		cell* offsets = mock_address(mock, params[1]);
+		cell* data = mock_address(mock, params[2]);
+
+		for(cell i = 0; i < params[3]; ++i)
+			result_landed(ids[i], 1, data[offsets[i]] == 0);
+
+		return;
+	}
+
+	if(options.batch == "single")
+	{
+		if(params.size() >= 4)
+			result_landed(params[3], params[1], params[2]);
+
+		return;
+	}
+
+	if(!options.batch.empty())
+	{
+		if(params.size() >= 2)
+			result_landed(params[1], 1, params[0] == 0);
+
+		return;
+	}
+
+	if(params.size() >= 4)
+		result_landed(params[3], 1, params[2] == 0);
+}
+
+static double percentile(vector<double>& samples, double p)
+{
+	if(samples.empty())
+		return 0.0;
+
+	size_t index = static_cast<size_t>(p / 100.0 * (samples.size() - 1) + 0.5);
+
+	return samples[index];
+}
+
+static void report(const char* name, const char* unit, vector<double>& samples)
+{
+	std::sort(samples.begin(), samples.end());
+
+	printf("%-10s p50 %10.3f  p95 %10.3f  p99 %10.3f  max %10.3f %s\n", name,
+		percentile(samples, 50), percentile(samples, 95), percentile(samples, 99),
+		samples.empty() ? 0.0 : samples.back(), unit);
+}
+
+static void usage()
+{
+	printf("usage: pawpy-bench <plugin.so> [options]\n");
+	printf("  --workload noop|cpu|sleep|array|array_string\n");
+	printf("                                   what each call does (default: noop)\n");
+	printf("  --mode threaded|main             RunPythonThreaded or RunPython (default: threaded)\n");
+	printf("  --calls N                        total calls to make (default: 10000)\n");
+	printf("  --per-tick N                     calls submitted per server tick (default: 100)\n");
+	printf("  --tick-rate N                    server ticks per second (default: 200)\n");
+	printf("  --cpu-iterations N               loop iterations for the cpu workload (default: 10000)\n");
+	printf("  --sleep-ms N                     sleep for the sleep workload (default: 10)\n");
+	printf("  --array-size N                   cells per array for the array workloads (default: 1000)\n");
+	printf("  --timeout N                      seconds to wait for every callback (default: 60)\n");
+	printf("  --workers N                      override pawpy_workers for this run\n");
+	printf("  --subinterpreters on|off         override pawpy_subinterpreters for this run\n");
+	printf("  --trace FILE                     write a Chrome trace of the run to FILE\n");
+	printf("  --batch loop|each|single         submit each tick's calls as a loop of RunPythonThreaded or as\n");
+	printf("                                   one RunPythonBatch with PY_BATCH_EACH or PY_BATCH_SINGLE\n");
+	printf("  --batched                        deliver each tick's results in one callback\n");
+	printf("  --quiet                          hide the plugin's log output\n");
+}
+
+static bool parse_options(int argc, char** argv)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+
+		if(arg == "--quiet")
+		{
+			options.quiet = true;
+			continue;
+		}
+
+		if(arg == "--batched")
+		{
+			options.batched = true;
+			continue;
+		}
+
+		if(arg.compare(0, 2, "--") != 0)
+		{
+			options.plugin = arg;
+			continue;
+		}
+
+		if(i + 1 >= argc)
+			return false;
+
+		string value = argv[++i];
+
+		if(arg == "--workload")
+			options.workload = value;
+		else if(arg == "--mode")
+			options.mode = value;
+		else if(arg == "--calls")
+			options.calls = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--per-tick")
+			options.per_tick = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--tick-rate")
+			options.tick_rate = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--cpu-iterations")
+			options.cpu_iterations = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--sleep-ms")
+			options.sleep_ms = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--array-size")
+			options.array_size = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--timeout")
+			options.timeout = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--workers")
+			options.workers = strtoul(value.c_str(), nullptr, 10);
+		else if(arg == "--subinterpreters")
+			options.subinterpreters = value;
+		else if(arg == "--batch")
+			options.batch = value;
+		else if(arg == "--trace")
+			options.trace = value;
+		else
+			return false;
+	}
+
+	if(options.plugin.empty() || options.per_tick == 0 || options.tick_rate == 0)
+		return false;
+
+	if(options.mode != "threaded" && options.mode != "main")
+		return false;
+
+	if(!options.subinterpreters.empty() && options.subinterpreters != "on" && options.subinterpreters != "off")
+		return false;
+
+	if(!options.batch.empty())
+	{
+		if(options.batch != "loop" && options.batch != "each" && options.batch != "single")
+			return false;
+
+		// RunPythonBatch only takes 'd' and 'f' columns
+		if(options.mode != "threaded" || options.workload == "array" || options.workload == "array_string")
+			return false;
+
+		// a PY_BATCH_SINGLE result is one call that owes many items
+		if(options.batch == "single" && options.batched)
+			return false;
+	}
+
+	return options.workload == "noop" || options.workload == "cpu" || options.workload == "sleep" ||
+		options.workload == "array" || options.workload == "array_string";
+}
+
+/*
+	Note:
+	The array_string workload passes the array the way the plugin used to,
+	as a "[0, 1, 2]" string the Python side has to parse again. The old
+	plugin formatted that string on the server thread for every call, so it
+	is formatted again for every call here (into the same cells) to keep
+	that cost in the tick time. Compare with the array workload, which
+	passes the same values as an "a" argument.
+*/
+static size_t array_string_cells()
+{
+	return options.array_size * 13 + 3;
+}
+
+static void format_array_string(mock_amx_t& mock, cell address)
+{
+	cell* cells = mock_address(mock, address);
+	char value[16];
+	size_t length = 0;
+
+	cells[length++] = '[';
+
+	for(unsigned int i = 0; i < options.array_size; ++i)
+	{
+		int written = snprintf(value, sizeof(value), i == 0 ? "%u" : ", %u", i);
+
+		for(int j = 0; j < written; ++j)
+			cells[length++] = value[j];
+	}
+
+	cells[length++] = ']';
+	cells[length] = 0;
+}
+
+/*
+	Note:
+	The plugin reads its settings from server.cfg in the working directory,
+	so --workers and --subinterpreters run the harness from a scratch
+	directory instead. It gets a copy of this directory's server.cfg with
+	those settings replaced and a link to bench.py, which lets the cpu
+	workload be compared with and without subinterpreters at any worker
+	count without editing server.cfg between runs.
+*/
+static string scratch;
+
+static bool override_settings()
+{
+	if(options.workers == 0 && options.subinterpreters.empty())
+		return true;
+
+	char* cwd = getcwd(nullptr, 0);
+	char* plugin = realpath(options.plugin.c_str(), nullptr);
+	char directory[] = "/tmp/pawpy-bench-XXXXXX";
+
+	if(cwd == nullptr || plugin == nullptr || mkdtemp(directory) == nullptr)
+	{
+		fprintf(stderr, "Failed to set up a directory for the settings: %s\n", strerror(errno));
+		free(cwd);
+		free(plugin);
+		return false;
+	}
+
+	string source = cwd;
+
+	scratch = directory;
+	options.plugin = plugin;
+
+	if(!options.trace.empty() && options.trace[0] != '/')
+		options.trace = source + "/" + options.trace;
+
+	free(cwd);
+	free(plugin);
+
+	std::ifstream input(source + "/server.cfg");
+	std::ofstream output(scratch + "/server.cfg");
+	string line;
+
+	while(std::getline(input, line))
+	{
+		if(options.workers > 0 && line.compare(0, 14, "pawpy_workers ") == 0)
+			continue;
+
+		if(!options.subinterpreters.empty() && line.compare(0, 22, "pawpy_subinterpreters ") == 0)
+			continue;
+
+		output << line << "\n";
+	}
+
+	if(options.workers > 0)
+		output << "pawpy_workers " << options.workers << "\n";
+
+	if(!options.subinterpreters.empty())
+		output << "pawpy_subinterpreters " << (options.subinterpreters == "on" ? 1 : 0) << "\n";
+
+	output.close();
+
+	if(symlink((source + "/bench.py").c_str(), (scratch + "/bench.py").c_str()) != 0 || chdir(scratch.c_str()) != 0)
+	{
+		fprintf(stderr, "Failed to set up %s: %s\n", scratch.c_str(), strerror(errno));
+		return false;
+	}
+
+	// keeps __pycache__ out of the scratch directory so it can be removed
+	setenv("PYTHONDONTWRITEBYTECODE", "1", 1);
+
+	return true;
+}
+
+static void remove_scratch()
+{
+	if(scratch.empty())
+		return;
+
+	unlink((scratch + "/server.cfg").c_str());
+	unlink((scratch + "/bench.py").c_str());
+	rmdir(scratch.c_str());
+}
+
+/*
+	Note:
+	The native parameters for one call of the workload, after the module and
+	function (and callback and return format for RunPythonThreaded). The
+	arguments are set up once, the native copies them on every call anyway.
+*/
+static vector<cell> workload_arguments(mock_amx_t& mock)
+{
+	if(options.workload == "cpu")
+		return {mock_string(mock, "d"), mock_data(mock, {static_cast<cell>(options.cpu_iterations)})};
+
+	if(options.workload == "sleep")
+		return {mock_string(mock, "d"), mock_data(mock, {static_cast<cell>(options.sleep_ms)})};
+
+	if(options.workload == "array")
+	{
+		vector<cell> values(options.array_size);
+
+		for(unsigned int i = 0; i < options.array_size; ++i)
+			values[i] = i;
+
+		return {mock_string(mock, "ad"), mock_data(mock, values), mock_data(mock, {static_cast<cell>(options.array_size)})};
+	}
+
+	if(options.workload == "array_string")
+	{
+		cell text = mock_data(mock, vector<cell>(array_string_cells(), 0));
+
+		format_array_string(mock, text);
+
+		return {mock_string(mock, "s"), text};
+	}
+
+	return {mock_string(mock, "")};
+}
+
+/*
+	Note:
+	The RunPythonBatch columns for the workload, one array of per_tick cells
+	per argument. The batch modes compare one RunPythonBatch per tick with
+	the same calls made as a loop of RunPythonThreaded (--batch loop), all
+	three call the workload's _value function with a "d" return format
+	because PY_BATCH_SINGLE needs one.
+*/
+static vector<cell> batch_arguments(mock_amx_t& mock)
+{
+	if(options.workload == "cpu")
+		return {mock_string(mock, "d"), mock_data(mock, vector<cell>(options.per_tick, options.cpu_iterations))};
+
+	if(options.workload == "sleep")
+		return {mock_string(mock, "d"), mock_data(mock, vector<cell>(options.per_tick, options.sleep_ms))};
+
+	return {mock_string(mock, "")};
+}
+
+
+int main(int argc, char** argv)
+{
+	if(!parse_options(argc, argv))
+	{
+		usage();
+		return 1;
+	}
+
+	if(!override_settings())
+	{
+		remove_scratch();
+		return 1;
+	}
+
+	void* plugin = dlopen(options.plugin.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+	if(plugin == nullptr)
+	{
+		fprintf(stderr, "Failed to load %s: %s\n", options.plugin.c_str(), dlerror());
+		return 1;
+	}
+
+	Load_t Load = reinterpret_cast<Load_t>(dlsym(plugin, "Load"));
+	Unload_t Unload = reinterpret_cast<Unload_t>(dlsym(plugin, "Unload"));
+	Supports_t Supports = reinterpret_cast<Supports_t>(dlsym(plugin, "Supports"));
+	AmxLoad_t AmxLoad = reinterpret_cast<AmxLoad_t>(dlsym(plugin, "AmxLoad"));
+	AmxUnload_t AmxUnload = reinterpret_cast<AmxUnload_t>(dlsym(plugin, "AmxUnload"));
+	ProcessTick_t ProcessTick = reinterpret_cast<ProcessTick_t>(dlsym(plugin, "ProcessTick"));
+
+	if(!Load || !Unload || !Supports || !AmxLoad || !AmxUnload || !ProcessTick)
+	{
+		fprintf(stderr, "%s is missing plugin exports.\n", options.plugin.c_str());
+		return 1;
+	}
+
+	if(!(Supports() & SUPPORTS_PROCESS_TICK))
+	{
+		fprintf(stderr, "%s doesn't support ProcessTick.\n", options.plugin.c_str());
+		return 1;
+	}
+
+	void* data[PLUGIN_DATA_AMX_EXPORTS + 1] = {nullptr};
+
+	setup_exports();
+	data[PLUGIN_DATA_LOGPRINTF] = reinterpret_cast<void*>(bench_logprintf);
+	data[PLUGIN_DATA_AMX_EXPORTS] = amx_exports;
+
+	if(!Load(data))
+	{
+		fprintf(stderr, "Load failed.\n");
+		return 1;
+	}
+
+	mock_amx_t* mock = mock_create();
+
+	mock->public_names.push_back("OnBenchResult");
+	on_result = result_received;
+
+	AmxLoad(&mock->amx);
+
+	bool threaded = options.mode == "threaded";
+	cell module = mock_string(*mock, "bench");
+	bool batch = options.batch == "each" || options.batch == "single";
+	cell function = mock_string(*mock, options.batch.empty() ? options.workload : options.workload + "_value");
+	cell callback = mock_string(*mock, "OnBenchResult");
+	cell return_format = mock_string(*mock, options.batch.empty() ? "" : "d");
+	cell output = mock_data(*mock, vector<cell>(256, 0));
+	vector<cell> arguments = workload_arguments(*mock);
+	vector<cell> threaded_args = {module, function, callback, return_format};
+	vector<cell> main_args = {module, function, output, 256};
+	bool reformat = options.workload == "array_string";
+
+	vector<cell> columns = batch_arguments(*mock);
+	vector<cell> batch_args = {module, function, callback, return_format, options.batch == "single" ? PY_BATCH_SINGLE : PY_BATCH_EACH, 0};
+
+	threaded_args.insert(threaded_args.end(), arguments.begin(), arguments.end());
+	main_args.insert(main_args.end(), arguments.begin(), arguments.end());
+	batch_args.insert(batch_args.end(), columns.begin(), columns.end());
+
+	AMX_NATIVE run_threaded = mock_find_native(*mock, "RunPythonThreaded");
+	AMX_NATIVE run_main = mock_find_native(*mock, "RunPython");
+	AMX_NATIVE run_batch = mock_find_native(*mock, "RunPythonBatch");
+
+	if(options.batched)
+		mock_native(*mock, mock_find_native(*mock, "SetPythonCallbackBatched"), {callback, 1});
+
+	if(!options.trace.empty())
+		mock_native(*mock, mock_find_native(*mock, "StartPythonTrace"), {mock_string(*mock, options.trace)});
+
+	submit_times.assign(options.calls, clock_type::time_point());
+	submit_items.assign(options.calls, 0);
+	latencies.reserve(options.calls);
+	tick_times.reserve(options.calls / options.per_tick + options.timeout * options.tick_rate + 1);
+
+	AMX_NATIVE get_stat = mock_find_native(*mock, "GetPythonStat");
+
+	printf("workload %s, %s%s%s%s, %u calls, %u per tick at %u ticks per second\n",
+		options.workload.c_str(), options.mode.c_str(), options.batch.empty() ? "" : " batch ",
+		options.batch.c_str(), options.batched ? " batched" : "",
+		options.calls, options.per_tick, options.tick_rate);
+	printf("workers %d, %d in their own subinterpreter\n",
+		mock_native(*mock, get_stat, {PY_STAT_WORKERS}), mock_native(*mock, get_stat, {PY_STAT_ISOLATED_WORKERS}));
+
+	clock_type::duration interval = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1.0 / options.tick_rate));
+	clock_type::time_point start = clock_type::now();
+	clock_type::time_point deadline = start + std::chrono::seconds(options.timeout);
+	clock_type::time_point next_tick = start;
+	clock_type::time_point tick_start;
+	unsigned int submitted = 0;
+
+	/*
+		Note:
+		Allocations are counted from when a tenth of the calls have been
+		submitted until the last one is, the first calls pay for imports,
+		interned names and containers growing to their working size.
+	*/
+	unsigned int warmup = options.calls / 10;
+	unsigned int measured_from = 0;
+	unsigned int measured_to = 0;
+	unsigned long allocations_from = 0;
+	unsigned long allocations_to = 0;
+
+	while(completed + rejected < options.calls && clock_type::now() < deadline)
+	{
+		tick_start = clock_type::now();
+
+		if(measured_from == 0 && submitted >= warmup && submitted > 0)
+		{
+			measured_from = submitted;
+			allocations_from = allocations;
+		}
+
+		for(unsigned int i = 0; i < options.per_tick && submitted < options.calls; ++i, ++submitted)
+		{
+			if(reformat)
+				format_array_string(*mock, arguments.back());
+
+			if(threaded)
+			{
+				unsigned int items = 1;
+				clock_type::time_point now = clock_type::now();
+				cell id;
+
+				if(batch)
+				{
+					items = std::min(options.per_tick, options.calls - submitted);
+					batch_args[5] = items;
+					id = mock_native(*mock, run_batch, batch_args);
+
+					// the whole tick's calls went in one go
+					i = options.per_tick;
+					submitted += items - 1;
+				}
+				else
+				{
+					id = mock_native(*mock, run_threaded, threaded_args);
+				}
+
+				if(id == 0)
+				{
+					rejected += items;
+					continue;
+				}
+
+				if(first_id == 0)
+					first_id = id;
+
+				if(static_cast<size_t>(id - first_id) < submit_times.size())
+				{
+					submit_times[id - first_id] = now;
+					submit_items[id - first_id] = items;
+					in_flight += items;
+				}
+
+				continue;
+			}
+
+			clock_type::time_point now = clock_type::now();
+			cell error = mock_native(*mock, run_main, main_args);
+			std::chrono::duration<double, std::milli> latency = clock_type::now() - now;
+
+			latencies.push_back(latency.count());
+			completed++;
+
+			if(error != 0 || *mock_address(*mock, output) == 0)
+				failed++;
+		}
+
+		ProcessTick();
+
+		if(measured_from > 0 && measured_to == 0 && submitted == options.calls)
+		{
+			measured_to = submitted;
+			allocations_to = allocations;
+		}
+
+		std::chrono::duration<double, std::micro> tick_time = clock_type::now() - tick_start;
+		tick_times.push_back(tick_time.count());
+
+		next_tick += interval;
+
+		if(next_tick < clock_type::now())
+			next_tick = clock_type::now();
+		else
+			std::this_thread::sleep_until(next_tick);
+	}
+
+	std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+	printf("completed %u of %u (%u failed, %u rejected, %u lost) in %.3fs: %.1f calls/s\n",
+		completed, options.calls, failed, rejected, in_flight,
+		elapsed.count(), completed / elapsed.count());
+	report("latency", "ms", latencies);
+	report("tick", "us", tick_times);
+	printf("callbacks  %u amx_Exec calls, heap peak %d bytes\n", callback_execs, heap_peak);
+
+	if(measured_to > measured_from)
+	{
+		printf("allocations %.2f per call (%lu over %u calls after warm-up)\n",
+			static_cast<double>(allocations_to - allocations_from) / (measured_to - measured_from),
+			allocations_to - allocations_from, measured_to - measured_from);
+	}
+
+	if(!options.trace.empty())
+		mock_native(*mock, mock_find_native(*mock, "StopPythonTrace"), {});
+
+	AmxUnload(&mock->amx);
+	Unload();
+	remove_scratch();
+
+	return completed == options.calls ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+# Workload functions for the pawpy-bench load test harness (bench.cpp).
+# Every function returns a non-empty string, the harness counts an empty
+# result as a failed call. The _value versions are for --batch, which needs
+# a "d" return format, they return a non-zero int instead.
+
+import json
+import time
+
+
+def noop():
+	return "ok"
+
+
+def cpu(iterations):
+	total = 0
+	for i in range(iterations):
+		total += i * i % 7
+	return str(total)
+
+
+def sleep(milliseconds):
+	time.sleep(milliseconds / 1000.0)
+	return "ok"
+
+
+def noop_value():
+	return 1
+
+
+def cpu_value(iterations):
+	return int(cpu(iterations)) + 1
+
+
+def sleep_value(milliseconds):
+	sleep(milliseconds)
+	return 1
+
+
+def array(values, size):
+	return str(sum(values))
+
+
+def array_string(text):
+	values = json.loads(text)
+	return str(sum(values))
@@ -0,0 +1,161 @@
+/*==============================================================================
+
+
+	Pawpy - Python Utility for Pawn
+
+		Copyright (C) 2016 Barnaby "Southclaw" Keene
+
+		This program is free software: you can redistribute it and/or modify it
+		under the terms of the GNU General Public License as published by the
+		Free Software Foundation, either version 3 of the License, or (at your
+		option) any later version.
+
+		This program is distributed in the hope that it will be useful, but
+		WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+		See the GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License along
+		with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	Note:
+		Stress test for the completion queue (Pawpy/mpsc_queue.hpp). A number
+		of producer threads push numbered items as fast as they can while one
+		consumer drains, just like the workers and ProcessTick do. Afterwards
+		every item must have come out exactly once and each producer's items
+		in the order it pushed them. Worth running under ThreadSanitizer too.
+
+		Build with "make queue-stress" from the repository root, then:
+
+			./pawpy-queue-stress [producers] [items per producer]
+
+		Exits with 0 if nothing was lost, duplicated or reordered.
+
+
+==============================================================================*/
+
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using std::vector;
+using std::thread;
+
+#include "../../Pawpy/mpsc_queue.hpp"
+
+
+struct item_t
+{
+	unsigned int producer;
+	unsigned int sequence;
+};
+
+int main(int argc, char** argv)
+{
+	unsigned int producers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+	unsigned int items = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+
+	if(producers == 0 || items == 0)
+	{
+		printf("usage: pawpy-queue-stress [producers] [items per producer]\n");
+		return 1;
+	}
+
+	Pawpy::mpsc_queue<item_t> queue;
+	std::atomic<unsigned int> ready(0);
+	std::atomic<bool> go(false);
+	vector<thread> threads;
+
+	for(unsigned int p = 0; p < producers; ++p)
+	{
+		threads.push_back(thread([&queue, &ready, &go, p, items]
+		{
+			ready++;
+
+			while(!go)
+				std::this_thread::yield();
+
+			for(unsigned int i = 0; i < items; ++i)
+				queue.push(item_t{p, i});
+		}));
+	}
+
+	while(ready < producers)
+		std::this_thread::yield();
+
+	/*
+		Note:
+		next[p] is the sequence number producer p's next item must have.
+	*/
+	vector<unsigned int> next(producers, 0);
+	vector<item_t> drained;
+	unsigned long long total = static_cast<unsigned long long>(producers) * items;
+	unsigned long long received = 0;
+	unsigned long long drains = 0;
+	unsigned long long errors = 0;
+
+	drained.reserve(65536);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	go = true;
+
+	while(received < total)
+	{
+		drained.clear();
+
+		if(queue.drain(drained) == 0)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		drains++;
+
+		for(auto& item : drained)
+		{
+			if(item.producer >= producers || item.sequence != next[item.producer])
+			{
+				if(errors++ < 10)
+					printf("out of order: producer %u item %u, expected %u\n", item.producer, item.sequence, item.producer < producers ? next[item.producer] : 0);
+			}
+
+			if(item.producer < producers)
+				next[item.producer] = item.sequence + 1;
+		}
+
+		received += drained.size();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for(auto& t : threads)
+		t.join();
+
+	drained.clear();
+	received += queue.drain(drained);
+
+	for(unsigned int p = 0; p < producers; ++p)
+	{
+		if(next[p] != items)
+		{
+			printf("producer %u: %u of %u items received\n", p, next[p], items);
+			errors++;
+		}
+	}
+
+	if(received != total)
+	{
+		printf("received %llu items, expected %llu\n", received, total);
+		errors++;
+	}
+
+	printf("%u producers, %llu items in %llu drains, %.3fs: %.1f million items/s, %s\n",
+		producers, received, drains, elapsed.count(), received / elapsed.count() / 1000000.0,
+		errors == 0 ? "no items lost or out of order" : "FAILED");
+
+	return errors == 0 ? 0 : 1;
+}